@@ -0,0 +1,184 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#include "FlockDistanceField.h"
+#include "PhysicsEngine/BodySetup.h"
+
+DEFINE_LOG_CATEGORY_STATIC(LogFlockDistanceField, Log, All);
+
+FlockDistanceField::FlockDistanceField()
+{
+	VoxelSize = 1.f;
+	InvVoxelSize = 1.f;
+	MaxDistance = 0.f;
+}
+
+void FlockDistanceField::Bake(const FBox& Bounds, float NewVoxelSize, float NewMaxDistance, const TArray<FlockObstacle>& Obstacles)
+{
+	VoxelSize = FMath::Max(NewVoxelSize, 1.f);
+	InvVoxelSize = 1.f / VoxelSize;
+	MaxDistance = FMath::Max(NewMaxDistance, VoxelSize);
+	Origin = Bounds.Min;
+
+	BrickIndices.Reset();
+	BrickSampleData.Reset();
+	NumBricks = FIntVector::ZeroValue;
+
+	if (!Bounds.IsValid) return;
+
+	// Bricks per axis in int64, a large obstacle (e.g. a floor) could overflow int32 at small voxels.
+	// An axis above MaxBricks is over the cap anyway, clamped so the product can not overflow.
+	FVector const Size = Bounds.GetSize();
+	auto CountBricks = [&Size](float BrickSize, int64 OutNum[3])
+	{
+		for (int32 Axis = 0; Axis < 3; ++Axis)
+		{
+			OutNum[Axis] = int64(FMath::Clamp(FMath::CeilToDouble(double(Size[Axis]) / BrickSize), 1.0, double(MaxBricks + 1)));
+		}
+		return OutNum[0] * OutNum[1] * OutNum[2];
+	};
+
+	// Dense brick index is capped, larger bounds get coarser voxels.
+	int64 Num[3];
+	int64 TotalBricks = CountBricks(VoxelSize * BrickCells, Num);
+	if (TotalBricks > MaxBricks)
+	{
+		float const RequestedVoxelSize = VoxelSize;
+		while (TotalBricks > MaxBricks)
+		{
+			VoxelSize *= FMath::Max(1.25f, FMath::Pow(float(double(TotalBricks) / MaxBricks), 1.f / 3.f));
+			TotalBricks = CountBricks(VoxelSize * BrickCells, Num);
+		}
+		InvVoxelSize = 1.f / VoxelSize;
+		MaxDistance = FMath::Max(NewMaxDistance, VoxelSize);
+		UE_LOG(LogFlockDistanceField, Warning, TEXT("Avoidance field bounds %s need more than %lld bricks, voxel size %.1f raised to %.1f."),
+		       *Size.ToString(), MaxBricks, RequestedVoxelSize, VoxelSize);
+	}
+
+	float const BrickSize = VoxelSize * BrickCells;
+	NumBricks = FIntVector(int32(Num[0]), int32(Num[1]), int32(Num[2]));
+	BrickIndices.Init(INDEX_NONE, int32(TotalBricks));
+
+	// Brick is near an obstacle if its center is closer than half diagonal plus MaxDistance.
+	float const BrickRadius = BrickSize * 0.5f * FMath::Sqrt(3.f);
+	float const NearDistance = MaxDistance + BrickRadius;
+	TArray<const FlockObstacle*> NearObstacles;
+
+	for (int32 Z = 0; Z < NumBricks.Z; ++Z)
+	{
+		for (int32 Y = 0; Y < NumBricks.Y; ++Y)
+		{
+			for (int32 X = 0; X < NumBricks.X; ++X)
+			{
+				FVector const BrickMin = Origin + FVector(X, Y, Z) * BrickSize;
+				FVector const BrickCenter = BrickMin + FVector(BrickSize * 0.5f);
+
+				NearObstacles.Reset();
+				for (FlockObstacle const& Obstacle : Obstacles)
+				{
+					// Bounds first, collision query only for bricks next to the obstacle.
+					if (Obstacle.Bounds.ComputeSquaredDistanceToPoint(BrickCenter) >= FMath::Square(NearDistance)) continue;
+
+					if (GetSignedDistance(Obstacle, BrickCenter) < NearDistance)
+					{
+						NearObstacles.Add(&Obstacle);
+					}
+				}
+
+				// Empty brick, lookup returns far.
+				if (NearObstacles.Num() == 0) continue;
+
+				BrickIndices[GetBrickIndex(X, Y, Z)] = GetNumBricks();
+				int32 const FirstSample = BrickSampleData.AddUninitialized(BrickSamples * BrickSamples * BrickSamples);
+
+				for (int32 SampleZ = 0; SampleZ < BrickSamples; ++SampleZ)
+				{
+					for (int32 SampleY = 0; SampleY < BrickSamples; ++SampleY)
+					{
+						for (int32 SampleX = 0; SampleX < BrickSamples; ++SampleX)
+						{
+							FVector const SampleLocation = BrickMin + FVector(SampleX, SampleY, SampleZ) * VoxelSize;
+
+							float MinDistance = MaxDistance;
+							for (const FlockObstacle* Obstacle : NearObstacles)
+							{
+								MinDistance = FMath::Min(MinDistance, GetSignedDistance(*Obstacle, SampleLocation));
+							}
+
+							BrickSampleData[FirstSample + GetSampleIndex(SampleX, SampleY, SampleZ)] = FMath::Max(MinDistance, -MaxDistance);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+float FlockDistanceField::GetSignedDistance(const FlockObstacle& Obstacle, const FVector& Location) const
+{
+	// Zero inside, negative if body setup has no simple collision to query.
+	float const Distance = Obstacle.BodySetup->GetShortestDistanceToPoint(Location, Obstacle.Transform);
+	if (Distance < 0.f) return MaxDistance;
+	if (Distance > 0.f || !Obstacle.LocalBounds.IsValid) return Distance;
+
+	// Inside, depth to the nearest face of the collision bounds. Exact for boxes, grows toward the center for other shapes,
+	// so gradient pushes out of the obstacle.
+	FVector const Local = Obstacle.Transform.InverseTransformPosition(Location);
+	FVector const Scale = Obstacle.Transform.GetScale3D().GetAbs();
+	FVector const Depth = (Local - Obstacle.LocalBounds.Min).ComponentMin(Obstacle.LocalBounds.Max - Local) * Scale;
+	return -FMath::Max(0.f, Depth.GetMin());
+}
+
+bool FlockDistanceField::Sample(const FVector& Location, float& OutDistance, FVector& OutGradient) const
+{
+	if (BrickIndices.Num() == 0) return false;
+
+	FVector const Local = (Location - Origin) * InvVoxelSize;
+	FIntVector const Cell(FMath::FloorToInt(Local.X), FMath::FloorToInt(Local.Y), FMath::FloorToInt(Local.Z));
+	if (Cell.X < 0 || Cell.Y < 0 || Cell.Z < 0) return false;
+
+	FIntVector const Brick(Cell.X / BrickCells, Cell.Y / BrickCells, Cell.Z / BrickCells);
+	if (Brick.X >= NumBricks.X || Brick.Y >= NumBricks.Y || Brick.Z >= NumBricks.Z) return false;
+
+	int32 const BrickIndex = BrickIndices[GetBrickIndex(Brick.X, Brick.Y, Brick.Z)];
+	if (BrickIndex == INDEX_NONE) return false;
+
+	const float* Samples = BrickSampleData.GetData() + BrickIndex * BrickSamples * BrickSamples * BrickSamples;
+
+	// Cell inside brick and position inside cell.
+	int32 const X = Cell.X - Brick.X * BrickCells;
+	int32 const Y = Cell.Y - Brick.Y * BrickCells;
+	int32 const Z = Cell.Z - Brick.Z * BrickCells;
+	float const FracX = Local.X - Cell.X;
+	float const FracY = Local.Y - Cell.Y;
+	float const FracZ = Local.Z - Cell.Z;
+
+	// Cell corners, SampleXYZ.
+	float const Sample000 = Samples[GetSampleIndex(X, Y, Z)];
+	float const Sample100 = Samples[GetSampleIndex(X + 1, Y, Z)];
+	float const Sample010 = Samples[GetSampleIndex(X, Y + 1, Z)];
+	float const Sample110 = Samples[GetSampleIndex(X + 1, Y + 1, Z)];
+	float const Sample001 = Samples[GetSampleIndex(X, Y, Z + 1)];
+	float const Sample101 = Samples[GetSampleIndex(X + 1, Y, Z + 1)];
+	float const Sample011 = Samples[GetSampleIndex(X, Y + 1, Z + 1)];
+	float const Sample111 = Samples[GetSampleIndex(X + 1, Y + 1, Z + 1)];
+
+	// Trilinear distance.
+	float const Sample00 = FMath::Lerp(Sample000, Sample100, FracX);
+	float const Sample10 = FMath::Lerp(Sample010, Sample110, FracX);
+	float const Sample01 = FMath::Lerp(Sample001, Sample101, FracX);
+	float const Sample11 = FMath::Lerp(Sample011, Sample111, FracX);
+	float const Sample0 = FMath::Lerp(Sample00, Sample10, FracY);
+	float const Sample1 = FMath::Lerp(Sample01, Sample11, FracY);
+
+	OutDistance = FMath::Lerp(Sample0, Sample1, FracZ);
+
+	// Derivatives of trilinear interpolation.
+	float const GradientX = FMath::Lerp(FMath::Lerp(Sample100 - Sample000, Sample110 - Sample010, FracY),
+	                                    FMath::Lerp(Sample101 - Sample001, Sample111 - Sample011, FracY), FracZ);
+	float const GradientY = FMath::Lerp(Sample10 - Sample00, Sample11 - Sample01, FracZ);
+	float const GradientZ = Sample1 - Sample0;
+
+	OutGradient = FVector(GradientX, GradientY, GradientZ) * InvVoxelSize;
+
+	return true;
+}
@@ -0,0 +1,139 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#include "FlockParallelFor.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "HAL/Event.h"
+#include "HAL/PlatformProcess.h"
+#include "Misc/App.h"
+
+// Claims is one atomic word, so a task can not take a chunk of a finished run:
+// run id in bits 48-63, number of chunks in bits 24-47, next chunk in bits 0-23.
+static constexpr uint64 ChunkBits = 24;
+static constexpr uint64 ChunkMask = (uint64(1) << ChunkBits) - 1;
+
+struct FlockParallelFor::Job
+{
+	Job()
+	{
+		Claims = 0;
+		NumChunksDone = 0;
+		NumQueuedTasks = 0;
+		DoneEvent = FPlatformProcess::GetSynchEventFromPool(true);
+	}
+
+	~Job()
+	{
+		FPlatformProcess::ReturnSynchEventToPool(DoneEvent);
+	}
+
+	// Take and run chunks until none is left.
+	void ProcessChunks()
+	{
+		for (;;)
+		{
+			uint64 Current = Claims.Load();
+			uint64 const NextChunk = Current & ChunkMask;
+			uint64 const NumChunks = (Current >> ChunkBits) & ChunkMask;
+			if (NextChunk >= NumChunks) return;
+			if (!Claims.CompareExchange(Current, Current + 1)) continue;
+
+			// Run of the claimed chunk can not finish before the chunk is done, so its body is valid.
+			int32 const First = int32(NextChunk) * ChunkSize;
+			int32 const Last = FMath::Min(First + ChunkSize, Num);
+			for (int32 Index = First; Index < Last; ++Index)
+			{
+				(*Body)(Index);
+			}
+
+			if (++NumChunksDone == int32(NumChunks))
+			{
+				DoneEvent->Trigger();
+			}
+		}
+	}
+
+	TAtomic<uint64> Claims;
+	TAtomic<int32> NumChunksDone;
+	// Dispatched tasks not finished yet, they still join the current run.
+	TAtomic<int32> NumQueuedTasks;
+	FEvent* DoneEvent = nullptr;
+	uint16 RunId = 0;
+	// Valid while a run is in progress.
+	const TFunctionRef<void(int32)>* Body = nullptr;
+	int32 Num = 0;
+	int32 ChunkSize = 1;
+};
+
+// Helps with the current run of its job.
+class FlockParallelForTask
+{
+public:
+
+	explicit FlockParallelForTask(const TSharedRef<FlockParallelFor::Job, ESPMode::ThreadSafe>& InJob)
+		: Job(InJob)
+	{
+	}
+
+	static ENamedThreads::Type GetDesiredThread() { return ENamedThreads::AnyHiPriThreadNormalTask; }
+	static ESubsequentsMode::Type GetSubsequentsMode() { return ESubsequentsMode::FireAndForget; }
+	FORCEINLINE TStatId GetStatId() const { RETURN_QUICK_DECLARE_CYCLE_STAT(FlockParallelForTask, STATGROUP_TaskGraphTasks); }
+
+	void DoTask(ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent)
+	{
+		Job->ProcessChunks();
+		--Job->NumQueuedTasks;
+	}
+
+private:
+
+	TSharedRef<FlockParallelFor::Job, ESPMode::ThreadSafe> Job;
+};
+
+FlockParallelFor::FlockParallelFor()
+	: CurrentJob(MakeShared<Job, ESPMode::ThreadSafe>())
+{
+}
+
+void FlockParallelFor::Run(int32 Num, int32 ChunkSize, TFunctionRef<void(int32)> Body)
+{
+	if (Num <= 0) return;
+
+	ChunkSize = FMath::Max(1, ChunkSize);
+	int32 const NumChunks = FMath::DivideAndRoundUp(Num, ChunkSize);
+	int32 const NumWorkers = FApp::ShouldUseThreadingForPerformance() ? FTaskGraphInterface::Get().GetNumWorkerThreads() : 0;
+	if (NumChunks == 1 || NumWorkers == 0 || uint64(NumChunks) > ChunkMask)
+	{
+		for (int32 Index = 0; Index < Num; ++Index)
+		{
+			Body(Index);
+		}
+		return;
+	}
+
+	Job& Data = CurrentJob.Get();
+	Data.Body = &Body;
+	Data.Num = Num;
+	Data.ChunkSize = ChunkSize;
+	Data.NumChunksDone = 0;
+	Data.DoneEvent->Reset();
+	++Data.RunId;
+	// Publishes the run, tasks read its data only after claiming a chunk of it.
+	Data.Claims = (uint64(Data.RunId) << (ChunkBits * 2)) | (uint64(NumChunks) << ChunkBits);
+
+	// Tasks still queued from earlier runs join this one, only missing ones are dispatched.
+	int32 const NumTasks = FMath::Min(NumWorkers, NumChunks - 1) - Data.NumQueuedTasks.Load();
+	for (int32 TaskIndex = 0; TaskIndex < NumTasks; ++TaskIndex)
+	{
+		++Data.NumQueuedTasks;
+		TGraphTask<FlockParallelForTask>::CreateTask().ConstructAndDispatchWhenReady(CurrentJob);
+	}
+
+	Data.ProcessChunks();
+
+	// Only chunks already taken by workers are waited for, not tasks that did not start.
+	if (Data.NumChunksDone.Load() != NumChunks)
+	{
+		Data.DoneEvent->Wait();
+	}
+	Data.Body = nullptr;
+}
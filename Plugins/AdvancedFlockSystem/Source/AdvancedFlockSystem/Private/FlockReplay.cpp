@@ -0,0 +1,389 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#include "FlockReplay.h"
+#include "Misc/FileHelper.h"
+#include "HAL/PlatformAtomics.h"
+#include "Math/Float16.h"
+
+DEFINE_LOG_CATEGORY_STATIC(LogFlockReplay, Log, All);
+
+namespace FlockReplay
+{
+	// Frame: delta time, number of members, payload size, then per member a mask byte and varints of changed fields.
+	// Mask bits 0-6 are X to QuatC, bit 7 is scale and flags together, they rarely change.
+	static constexpr uint8 RareFieldsBit = 1 << 7;
+	static constexpr float Sqrt2 = 1.41421356f;
+
+	void WriteVarint(TArray<uint8>& Data, int32 Value)
+	{
+		// Zigzag, small negative deltas take one byte too.
+		uint32 Bits = (uint32(Value) << 1) ^ uint32(Value >> 31);
+		while (Bits >= 0x80)
+		{
+			Data.Add(uint8(Bits | 0x80));
+			Bits >>= 7;
+		}
+		Data.Add(uint8(Bits));
+	}
+
+	// False if the varint does not end before DataEnd.
+	bool ReadVarint(const uint8*& Data, const uint8* DataEnd, int32& OutValue)
+	{
+		uint32 Bits = 0;
+		for (int32 Shift = 0; Shift < 35; Shift += 7)
+		{
+			if (Data >= DataEnd) return false;
+			uint8 const Byte = *Data++;
+			Bits |= uint32(Byte & 0x7F) << Shift;
+			if ((Byte & 0x80) == 0)
+			{
+				OutValue = int32(Bits >> 1) ^ -int32(Bits & 1);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool ReadDelta(const uint8*& Data, const uint8* DataEnd, int32& InOutValue)
+	{
+		int32 Delta = 0;
+		if (!ReadVarint(Data, DataEnd, Delta)) return false;
+		InOutValue += Delta;
+		return true;
+	}
+
+	static constexpr int32 FrameHeaderSize = sizeof(float) + sizeof(int32) * 2;
+
+	// Largest component is dropped, q and -q are the same rotation so it is always positive.
+	void QuantizeQuat(const FQuat& Rotation, QuantizedMember& OutMember)
+	{
+		FQuat const Q = Rotation.GetNormalized();
+		float const Components[4] = { Q.X, Q.Y, Q.Z, Q.W };
+
+		int32 LargestIndex = 0;
+		for (int32 i = 1; i < 4; ++i)
+		{
+			if (FMath::Abs(Components[i]) > FMath::Abs(Components[LargestIndex]))
+			{
+				LargestIndex = i;
+			}
+		}
+		float const Sign = Components[LargestIndex] < 0.f ? -1.f : 1.f;
+
+		OutMember.Values[QuantizedMember::QuatIndex] = LargestIndex;
+		int32 Field = QuantizedMember::QuatA;
+		for (int32 i = 0; i < 4; ++i)
+		{
+			if (i == LargestIndex) continue;
+			// Other components are in [-1/sqrt(2), 1/sqrt(2)].
+			OutMember.Values[Field++] = FMath::Clamp(FMath::RoundToInt(Components[i] * Sign * Sqrt2 * 32767.f), -32767, 32767);
+		}
+	}
+
+	FQuat DequantizeQuat(const QuantizedMember& Member)
+	{
+		float Components[4];
+		int32 const LargestIndex = Member.Values[QuantizedMember::QuatIndex] & 3;
+		int32 Field = QuantizedMember::QuatA;
+		float SumSquared = 0.f;
+		for (int32 i = 0; i < 4; ++i)
+		{
+			if (i == LargestIndex) continue;
+			Components[i] = Member.Values[Field++] * (1.f / (Sqrt2 * 32767.f));
+			SumSquared += FMath::Square(Components[i]);
+		}
+		Components[LargestIndex] = FMath::Sqrt(FMath::Max(0.f, 1.f - SumSquared));
+		return FQuat(Components[0], Components[1], Components[2], Components[3]);
+	}
+}
+
+FlockReplayRecorder::FlockReplayRecorder(const FBox& Bounds, int32 KeyframeInterval)
+{
+	FileHeader.Magic = FlockReplay::Magic;
+	FileHeader.Version = FlockReplay::Version;
+	FileHeader.KeyframeInterval = FMath::Max(1, KeyframeInterval);
+	FileHeader.BoundsMin = Bounds.Min;
+	FileHeader.BoundsSize = Bounds.GetSize().ComponentMax(FVector(1.f));
+}
+
+void FlockReplayRecorder::BeginFrame(int32 NumChunks, int32 NumMembers)
+{
+	// Members added while recording start from zero, player does the same.
+	FrameNumMembers = bFull ? 0 : NumMembers;
+	if (PreviousMembers.Num() < FrameNumMembers)
+	{
+		PreviousMembers.SetNum(FrameNumMembers);
+	}
+	FileHeader.NumMembers = FMath::Max(FileHeader.NumMembers, FrameNumMembers);
+
+	// Only grow, chunk buffers keep their memory between frames.
+	if (ChunkData.Num() < NumChunks)
+	{
+		ChunkData.SetNum(NumChunks);
+	}
+	for (int32 ChunkIndex = 0; ChunkIndex < NumChunks; ++ChunkIndex)
+	{
+		ChunkData[ChunkIndex].Reset();
+	}
+	bKeyframe = NumFrames % FileHeader.KeyframeInterval == 0;
+}
+
+void FlockReplayRecorder::EncodeChunk(int32 ChunkIndex, const FlockMemberStore& Members, int32 FirstMember, int32 LastMember)
+{
+	using namespace FlockReplay;
+
+	uint64 const StartCycles = FPlatformTime::Cycles64();
+	TArray<uint8>& Data = ChunkData[ChunkIndex];
+	LastMember = FMath::Min(LastMember, FrameNumMembers);
+	FVector const Scale = FVector(65535.f) / FileHeader.BoundsSize;
+
+	for (int32 FlockMemberID = FirstMember; FlockMemberID < LastMember; ++FlockMemberID)
+	{
+		QuantizedMember Member;
+		FVector const Local = (Members.GetLocation(FlockMemberID) - FileHeader.BoundsMin) * Scale;
+		Member.Values[QuantizedMember::X] = FMath::Clamp(FMath::RoundToInt(Local.X), 0, 65535);
+		Member.Values[QuantizedMember::Y] = FMath::Clamp(FMath::RoundToInt(Local.Y), 0, 65535);
+		Member.Values[QuantizedMember::Z] = FMath::Clamp(FMath::RoundToInt(Local.Z), 0, 65535);
+		QuantizeQuat(Members.Orientations[FlockMemberID], Member);
+		Member.Values[QuantizedMember::Scale] = FFloat16(Members.Positions[FlockMemberID].W).Encoded;
+		Member.Values[QuantizedMember::Flags] = Members.Flags[FlockMemberID];
+
+		// Keyframe is a delta to zero.
+		QuantizedMember& Previous = PreviousMembers[FlockMemberID];
+		int32 Deltas[QuantizedMember::Num];
+		for (int32 Field = 0; Field < QuantizedMember::Num; ++Field)
+		{
+			Deltas[Field] = Member.Values[Field] - (bKeyframe ? 0 : Previous.Values[Field]);
+		}
+
+		uint8 Mask = 0;
+		for (int32 Field = 0; Field < QuantizedMember::Scale; ++Field)
+		{
+			Mask |= Deltas[Field] != 0 ? uint8(1 << Field) : 0;
+		}
+		Mask |= Deltas[QuantizedMember::Scale] != 0 || Deltas[QuantizedMember::Flags] != 0 ? RareFieldsBit : 0;
+
+		Data.Add(Mask);
+		for (int32 Field = 0; Field < QuantizedMember::Scale; ++Field)
+		{
+			if (Deltas[Field] != 0)
+			{
+				WriteVarint(Data, Deltas[Field]);
+			}
+		}
+		if (Mask & RareFieldsBit)
+		{
+			WriteVarint(Data, Deltas[QuantizedMember::Scale]);
+			WriteVarint(Data, Deltas[QuantizedMember::Flags]);
+		}
+
+		Previous = Member;
+	}
+
+	FPlatformAtomics::InterlockedAdd(&RecordCycles, int64(FPlatformTime::Cycles64() - StartCycles));
+}
+
+void FlockReplayRecorder::EndFrame(float FrameDeltaTime, float StepTime)
+{
+	if (bFull) return;
+
+	uint64 const StartCycles = FPlatformTime::Cycles64();
+
+	int64 PayloadSize = 0;
+	for (TArray<uint8> const& Data : ChunkData)
+	{
+		PayloadSize += Data.Num();
+	}
+
+	// Later frames are deltas to this one, so none is recorded after the first that does not fit.
+	if (FrameData.Num() + FlockReplay::FrameHeaderSize + PayloadSize > FlockReplay::MaxFrameDataBytes)
+	{
+		bFull = true;
+		UE_LOG(LogFlockReplay, Warning, TEXT("Flock recording reached %lld bytes, frames after %d are not recorded."), FlockReplay::MaxFrameDataBytes, NumFrames);
+		return;
+	}
+
+	if (bKeyframe)
+	{
+		KeyframeOffsets.Add(FrameData.Num());
+	}
+
+	int32 const FramePayloadSize = int32(PayloadSize);
+	int32 const FrameStart = FrameData.AddUninitialized(FlockReplay::FrameHeaderSize);
+	FMemory::Memcpy(FrameData.GetData() + FrameStart, &FrameDeltaTime, sizeof(float));
+	FMemory::Memcpy(FrameData.GetData() + FrameStart + sizeof(float), &FrameNumMembers, sizeof(int32));
+	FMemory::Memcpy(FrameData.GetData() + FrameStart + sizeof(float) + sizeof(int32), &FramePayloadSize, sizeof(int32));
+	for (TArray<uint8> const& Data : ChunkData)
+	{
+		FrameData.Append(Data);
+	}
+
+	++NumFrames;
+	Duration += FrameDeltaTime;
+	StepSeconds += StepTime;
+
+	FPlatformAtomics::InterlockedAdd(&RecordCycles, int64(FPlatformTime::Cycles64() - StartCycles));
+}
+
+bool FlockReplayRecorder::Save(const FString& FileName) const
+{
+	FlockReplay::Header SavedHeader = FileHeader;
+	SavedHeader.NumFrames = NumFrames;
+
+	TArray<uint8> FileData;
+	FileData.Reserve(int32(GetNumBytes()));
+	FileData.Append(reinterpret_cast<const uint8*>(&SavedHeader), int32(sizeof(SavedHeader)));
+	FileData.Append(reinterpret_cast<const uint8*>(KeyframeOffsets.GetData()), KeyframeOffsets.Num() * int32(sizeof(int64)));
+	FileData.Append(FrameData);
+
+	if (!FFileHelper::SaveArrayToFile(FileData, *FileName))
+	{
+		UE_LOG(LogFlockReplay, Error, TEXT("Failed to write flock replay to %s"), *FileName);
+		return false;
+	}
+	return true;
+}
+
+void FlockReplayRecorder::LogSummary(int32 NumActiveMembers) const
+{
+	double const MemberSeconds = double(FMath::Max(1, NumActiveMembers)) * FMath::Max(Duration, double(SMALL_NUMBER));
+	UE_LOG(LogFlockReplay, Display, TEXT("Flock recording: %d frames%s, %.2f s, %lld bytes, %.2f bytes per member per second, encoding %.2f%% of step time."),
+	       NumFrames, bFull ? TEXT(" (full, later frames dropped)") : TEXT(""), Duration, GetNumBytes(), GetNumBytes() / MemberSeconds,
+	       100.0 * GetRecordSeconds() / FMath::Max(StepSeconds, double(SMALL_NUMBER)));
+}
+
+bool FlockReplayPlayer::Load(const FString& FileName)
+{
+	TArray<uint8> FileData;
+	if (!FFileHelper::LoadFileToArray(FileData, *FileName))
+	{
+		UE_LOG(LogFlockReplay, Warning, TEXT("Failed to read flock replay %s."), *FileName);
+		return false;
+	}
+
+	FlockReplay::Header LoadedHeader;
+	if (FileData.Num() < int32(sizeof(LoadedHeader))) return false;
+	FMemory::Memcpy(&LoadedHeader, FileData.GetData(), sizeof(LoadedHeader));
+	if (LoadedHeader.Magic != FlockReplay::Magic || LoadedHeader.Version != FlockReplay::Version || LoadedHeader.NumFrames <= 0
+		|| LoadedHeader.NumMembers < 0 || LoadedHeader.KeyframeInterval <= 0)
+	{
+		UE_LOG(LogFlockReplay, Warning, TEXT("Flock replay %s has other version or no frames."), *FileName);
+		return false;
+	}
+
+	int32 const NumKeyframes = FMath::DivideAndRoundUp(LoadedHeader.NumFrames, LoadedHeader.KeyframeInterval);
+	int64 const FramesStart = int64(sizeof(LoadedHeader)) + NumKeyframes * int64(sizeof(int64));
+	if (FileData.Num() < FramesStart)
+	{
+		UE_LOG(LogFlockReplay, Warning, TEXT("Flock replay %s is truncated."), *FileName);
+		return false;
+	}
+
+	FileHeader = LoadedHeader;
+	KeyframeOffsets.SetNumUninitialized(NumKeyframes);
+	FMemory::Memcpy(KeyframeOffsets.GetData(), FileData.GetData() + sizeof(LoadedHeader), NumKeyframes * sizeof(int64));
+	FrameData.Reset();
+	FrameData.Append(FileData.GetData() + FramesStart, FileData.Num() - int32(FramesStart));
+
+	PreviousMembers.Reset();
+	PreviousMembers.SetNum(FileHeader.NumMembers);
+	NextFrame = 0;
+	NextFrameOffset = 0;
+	bCorrupt = false;
+	return true;
+}
+
+float FlockReplayPlayer::GetNextFrameDeltaTime() const
+{
+	float FrameDeltaTime = 0.f;
+	if (NextFrameOffset + int64(sizeof(float)) <= FrameData.Num())
+	{
+		FMemory::Memcpy(&FrameDeltaTime, FrameData.GetData() + NextFrameOffset, sizeof(float));
+	}
+	return FMath::Max(FrameDeltaTime, KINDA_SMALL_NUMBER);
+}
+
+void FlockReplayPlayer::DecodeNextFrame(FlockMemberStore& Members)
+{
+	using namespace FlockReplay;
+
+	int32 const NumMembers = FileHeader.NumMembers;
+	if (Members.Num() != NumMembers)
+	{
+		Members.SetNumUninitialized(NumMembers);
+		for (int32 FlockMemberID = 0; FlockMemberID < NumMembers; ++FlockMemberID)
+		{
+			Members.Velocities[FlockMemberID] = FVector4(0.f, 0.f, 0.f, 0.f);
+			Members.WanderTargets[FlockMemberID] = FVector4(0.f, 0.f, 0.f, 0.f);
+			Members.InstanceIndices[FlockMemberID] = FlockMemberID;
+			Members.RandomSeeds[FlockMemberID] = 0;
+		}
+	}
+
+	// Deltas after a broken frame would be applied to wrong members, so the replay stays on the last good frame.
+	if (bCorrupt) return;
+
+	int32 FrameNumMembers = -1;
+	int32 PayloadSize = -1;
+	if (NextFrameOffset + FrameHeaderSize <= FrameData.Num())
+	{
+		FMemory::Memcpy(&FrameNumMembers, FrameData.GetData() + NextFrameOffset + sizeof(float), sizeof(int32));
+		FMemory::Memcpy(&PayloadSize, FrameData.GetData() + NextFrameOffset + sizeof(float) + sizeof(int32), sizeof(int32));
+	}
+	int64 const PayloadStart = NextFrameOffset + FrameHeaderSize;
+	if (FrameNumMembers < 0 || FrameNumMembers > NumMembers || PayloadSize < 0 || PayloadStart + PayloadSize > FrameData.Num())
+	{
+		bCorrupt = true;
+		UE_LOG(LogFlockReplay, Warning, TEXT("Flock replay frame %d is truncated, replay stops."), NextFrame);
+		return;
+	}
+
+	bool const bKeyframe = NextFrame % FileHeader.KeyframeInterval == 0;
+	const uint8* Data = FrameData.GetData() + PayloadStart;
+	const uint8* DataEnd = Data + PayloadSize;
+	FVector const Scale = FileHeader.BoundsSize / 65535.f;
+
+	for (int32 FlockMemberID = 0; FlockMemberID < FrameNumMembers; ++FlockMemberID)
+	{
+		QuantizedMember& Member = PreviousMembers[FlockMemberID];
+		if (bKeyframe)
+		{
+			Member = QuantizedMember();
+		}
+
+		bool bRead = Data < DataEnd;
+		uint8 const Mask = bRead ? *Data++ : 0;
+		for (int32 Field = 0; bRead && Field < QuantizedMember::Scale; ++Field)
+		{
+			if (Mask & (1 << Field))
+			{
+				bRead = ReadDelta(Data, DataEnd, Member.Values[Field]);
+			}
+		}
+		if (bRead && (Mask & RareFieldsBit))
+		{
+			bRead = ReadDelta(Data, DataEnd, Member.Values[QuantizedMember::Scale]) && ReadDelta(Data, DataEnd, Member.Values[QuantizedMember::Flags]);
+		}
+		if (!bRead)
+		{
+			bCorrupt = true;
+			UE_LOG(LogFlockReplay, Warning, TEXT("Flock replay frame %d ends inside member %d, replay stops."), NextFrame, FlockMemberID);
+			return;
+		}
+
+		FFloat16 MemberScale;
+		MemberScale.Encoded = uint16(Member.Values[QuantizedMember::Scale]);
+		FVector const Location = FileHeader.BoundsMin + FVector(Member.Values[QuantizedMember::X], Member.Values[QuantizedMember::Y], Member.Values[QuantizedMember::Z]) * Scale;
+		Members.Positions[FlockMemberID] = FVector4(Location, MemberScale.GetFloat());
+		Members.Orientations[FlockMemberID] = DequantizeQuat(Member);
+		Members.Flags[FlockMemberID] = uint8(Member.Values[QuantizedMember::Flags]);
+	}
+
+	// Loop from the first keyframe.
+	NextFrameOffset = PayloadStart + PayloadSize;
+	if (++NextFrame >= FileHeader.NumFrames)
+	{
+		NextFrame = 0;
+		NextFrameOffset = KeyframeOffsets.Num() > 0 ? KeyframeOffsets[0] : 0;
+	}
+}
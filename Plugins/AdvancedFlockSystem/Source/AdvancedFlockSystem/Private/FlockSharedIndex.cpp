@@ -0,0 +1,35 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#include "FlockSharedIndex.h"
+
+void FlockSharedIndex::Reset()
+{
+	NumFlocks = 0;
+}
+
+void FlockSharedIndex::AddFlock(const FlockMemberStore& Members)
+{
+	if (NumFlocks == FlockPositions.Num())
+	{
+		FlockPositions.AddDefaulted();
+		FlockGrids.AddDefaulted();
+	}
+
+	TArray<FVector4>& Positions = FlockPositions[NumFlocks];
+	Positions.Reset();
+	for (int32 FlockMemberID = 0; FlockMemberID < Members.Num(); ++FlockMemberID)
+	{
+		if (!Members.HasFlag(FlockMemberID, FlockMemberFlags::Active)) continue;
+
+		Positions.Add(Members.Positions[FlockMemberID]);
+	}
+	++NumFlocks;
+}
+
+void FlockSharedIndex::Build(float CellSize)
+{
+	for (int32 FlockIndex = 0; FlockIndex < NumFlocks; ++FlockIndex)
+	{
+		FlockGrids[FlockIndex].Build(FlockPositions[FlockIndex].GetData(), FlockPositions[FlockIndex].Num(), CellSize);
+	}
+}
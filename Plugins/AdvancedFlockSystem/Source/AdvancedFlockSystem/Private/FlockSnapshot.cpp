@@ -0,0 +1,130 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#include "FlockSnapshot.h"
+#include "Async/MappedFileHandle.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/FileHelper.h"
+
+DEFINE_LOG_CATEGORY_STATIC(LogFlockSnapshot, Log, All);
+
+namespace FlockSnapshot
+{
+	// Call Func(Data, ElementSize) for every stream of Members, in file order.
+	template <typename StoreType, typename FuncType>
+	void ForEachStream(StoreType& Members, FuncType Func)
+	{
+		Func(Members.Positions.GetData(), int32(sizeof(FVector4)));
+		Func(Members.Velocities.GetData(), int32(sizeof(FVector4)));
+		Func(Members.Orientations.GetData(), int32(sizeof(FQuat)));
+		Func(Members.WanderTargets.GetData(), int32(sizeof(FVector4)));
+		Func(Members.Flags.GetData(), int32(sizeof(uint8)));
+		Func(Members.InstanceIndices.GetData(), int32(sizeof(int32)));
+		Func(Members.RandomSeeds.GetData(), int32(sizeof(int32)));
+	}
+
+	// Stream offsets for NumMembers, returns file size.
+	uint64 GetStreamOffsets(int32 NumMembers, uint64 (&OutOffsets)[NumStreams])
+	{
+		FlockMemberStore const EmptyMembers;
+		uint64 Offset = Align(sizeof(Header), 16);
+		int32 StreamIndex = 0;
+		ForEachStream(EmptyMembers, [&](const void*, int32 ElementSize)
+		{
+			OutOffsets[StreamIndex++] = Offset;
+			Offset = Align(Offset + uint64(ElementSize) * NumMembers, 16);
+		});
+		return Offset;
+	}
+
+	bool Save(const FString& FileName, const FlockMemberStore& Members, int32 SimulationSeed)
+	{
+		Header FileHeader;
+		FileHeader.Magic = Magic;
+		FileHeader.Version = Version;
+		FileHeader.NumMembers = Members.Num();
+		FileHeader.SimulationSeed = SimulationSeed;
+		uint64 const FileSize = GetStreamOffsets(Members.Num(), FileHeader.StreamOffsets);
+
+		TArray<uint8> FileData;
+		FileData.SetNumZeroed(int32(FileSize));
+		FMemory::Memcpy(FileData.GetData(), &FileHeader, sizeof(Header));
+
+		int32 StreamIndex = 0;
+		ForEachStream(Members, [&](const void* Data, int32 ElementSize)
+		{
+			FMemory::Memcpy(FileData.GetData() + FileHeader.StreamOffsets[StreamIndex++], Data, SIZE_T(ElementSize) * Members.Num());
+		});
+
+		if (!FFileHelper::SaveArrayToFile(FileData, *FileName))
+		{
+			UE_LOG(LogFlockSnapshot, Error, TEXT("Failed to write flock snapshot to %s"), *FileName);
+			return false;
+		}
+		return true;
+	}
+
+	// Validate and copy file bytes into OutMembers.
+	bool LoadFromMemory(const uint8* Data, uint64 DataSize, const FString& FileName, FlockMemberStore& OutMembers, int32& OutSimulationSeed)
+	{
+		if (DataSize < sizeof(Header))
+		{
+			UE_LOG(LogFlockSnapshot, Warning, TEXT("Flock snapshot %s is truncated."), *FileName);
+			return false;
+		}
+
+		Header FileHeader;
+		FMemory::Memcpy(&FileHeader, Data, sizeof(Header));
+		if (FileHeader.Magic != Magic || FileHeader.Version != Version || FileHeader.NumMembers < 0)
+		{
+			UE_LOG(LogFlockSnapshot, Warning, TEXT("Flock snapshot %s has other version, expected %u."), *FileName, Version);
+			return false;
+		}
+
+		uint64 ExpectedOffsets[NumStreams];
+		if (GetStreamOffsets(FileHeader.NumMembers, ExpectedOffsets) > DataSize
+			|| FMemory::Memcmp(ExpectedOffsets, FileHeader.StreamOffsets, sizeof(ExpectedOffsets)) != 0)
+		{
+			UE_LOG(LogFlockSnapshot, Warning, TEXT("Flock snapshot %s is truncated."), *FileName);
+			return false;
+		}
+
+		OutMembers.SetNumUninitialized(FileHeader.NumMembers);
+		int32 StreamIndex = 0;
+		ForEachStream(OutMembers, [&](void* StreamData, int32 ElementSize)
+		{
+			FMemory::Memcpy(StreamData, Data + FileHeader.StreamOffsets[StreamIndex++], SIZE_T(ElementSize) * FileHeader.NumMembers);
+		});
+		OutSimulationSeed = FileHeader.SimulationSeed;
+		return true;
+	}
+
+	bool Load(const FString& FileName, FlockMemberStore& OutMembers, int32& OutSimulationSeed)
+	{
+		IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+		if (!PlatformFile.FileExists(*FileName))
+		{
+			UE_LOG(LogFlockSnapshot, Warning, TEXT("Flock snapshot %s not found."), *FileName);
+			return false;
+		}
+
+		// Mapped file is paged in by memcpy of streams, no read into a temporary buffer.
+		TUniquePtr<IMappedFileHandle> MappedFile(PlatformFile.OpenMapped(*FileName));
+		if (MappedFile.IsValid())
+		{
+			TUniquePtr<IMappedFileRegion> MappedRegion(MappedFile->MapRegion(0, MappedFile->GetFileSize()));
+			if (MappedRegion.IsValid())
+			{
+				return LoadFromMemory(MappedRegion->GetMappedPtr(), MappedRegion->GetMappedSize(), FileName, OutMembers, OutSimulationSeed);
+			}
+		}
+
+		// Platforms without memory mapping.
+		TArray<uint8> FileData;
+		if (!FFileHelper::LoadFileToArray(FileData, *FileName))
+		{
+			UE_LOG(LogFlockSnapshot, Warning, TEXT("Failed to read flock snapshot %s."), *FileName);
+			return false;
+		}
+		return LoadFromMemory(FileData.GetData(), FileData.Num(), FileName, OutMembers, OutSimulationSeed);
+	}
+}
@@ -0,0 +1,129 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#include "FlockSpatialGrid.h"
+
+FlockSpatialGrid::FlockSpatialGrid()
+{
+	CellSize = 1.f;
+	InvCellSize = 1.f;
+	BucketMask = 0;
+}
+
+void FlockSpatialGrid::Build(const FVector4* Positions, int32 NumPositions, float NewCellSize, const uint8* Flags, uint8 RequiredFlags)
+{
+	CellSize = FMath::Max(NewCellSize, 1.f);
+	InvCellSize = 1.f / CellSize;
+
+	// Twice more buckets than positions keeps collisions rare.
+	uint32 const NumBuckets = FMath::RoundUpToPowerOfTwo(FMath::Max(NumPositions * 2, 64));
+	BucketMask = NumBuckets - 1;
+
+	BucketStart.Reset();
+	BucketStart.SetNumZeroed(NumBuckets + 1, false);
+	PositionBuckets.SetNumUninitialized(NumPositions, false);
+
+	// Count positions in every bucket.
+	int32 NumAdded = 0;
+	for (int32 i = 0; i < NumPositions; ++i)
+	{
+		if (Flags && (Flags[i] & RequiredFlags) != RequiredFlags)
+		{
+			PositionBuckets[i] = INDEX_NONE;
+			continue;
+		}
+
+		++NumAdded;
+		int32 const Bucket = GetBucket(GetCell(Positions[i]));
+		PositionBuckets[i] = Bucket;
+		++BucketStart[Bucket + 1];
+	}
+
+	for (uint32 Bucket = 0; Bucket < NumBuckets; ++Bucket)
+	{
+		BucketStart[Bucket + 1] += BucketStart[Bucket];
+	}
+
+	// Scatter positions in bucket order. Stable, so the order is the same for the same input.
+	BucketCursor.SetNumUninitialized(BucketStart.Num(), false);
+	FMemory::Memcpy(BucketCursor.GetData(), BucketStart.GetData(), BucketStart.Num() * sizeof(int32));
+	SortedIndices.SetNumUninitialized(NumAdded, false);
+	SortedPositions.SetNumUninitialized(NumAdded, false);
+	SortedCells.SetNumUninitialized(NumAdded, false);
+
+	for (int32 i = 0; i < NumPositions; ++i)
+	{
+		if (PositionBuckets[i] == INDEX_NONE) continue;
+
+		int32 const Slot = BucketCursor[PositionBuckets[i]]++;
+		SortedIndices[Slot] = i;
+		SortedPositions[Slot] = FVector(Positions[i].X, Positions[i].Y, Positions[i].Z);
+		SortedCells[Slot] = GetCell(Positions[i]);
+	}
+}
+
+void FlockSpatialGrid::FindNearest(const FVector& Location, float Radius, int32 MaxCount, int32 ExcludeIndex, TArray<int32>& OutIndices) const
+{
+	OutIndices.Reset();
+	if (SortedIndices.Num() == 0 || MaxCount <= 0) return;
+	MaxCount = FMath::Min(MaxCount, MaxNearest);
+
+	// Sorted by distance, then index, so the same input selects the same mates.
+	TArray<float, TInlineAllocator<MaxNearest>> DistancesSquared;
+	float MaxDistanceSquared = FMath::Square(Radius);
+
+	int32 const MaxRange = FMath::Max(1, FMath::CeilToInt(Radius * InvCellSize));
+	FIntVector const CenterCell = GetCell(Location);
+
+	for (int32 Range = 0; Range <= MaxRange; ++Range)
+	{
+		// Location is in the center cell, so positions in this ring are at least (Range - 1) cells away.
+		if (OutIndices.Num() == MaxCount && FMath::Square(FMath::Max(Range - 1, 0) * CellSize) >= MaxDistanceSquared) break;
+
+		for (int32 Z = -Range; Z <= Range; ++Z)
+		{
+			for (int32 Y = -Range; Y <= Range; ++Y)
+			{
+				// Only the shell of the ring, inner cells are visited already.
+				bool const bShellYZ = FMath::Abs(Z) == Range || FMath::Abs(Y) == Range;
+				int32 const StepX = bShellYZ || Range == 0 ? 1 : 2 * Range;
+
+				for (int32 X = -Range; X <= Range; X += StepX)
+				{
+					FIntVector const Cell(CenterCell.X + X, CenterCell.Y + Y, CenterCell.Z + Z);
+					int32 const Bucket = GetBucket(Cell);
+
+					for (int32 Slot = BucketStart[Bucket]; Slot < BucketStart[Bucket + 1]; ++Slot)
+					{
+						if (SortedCells[Slot] != Cell || SortedIndices[Slot] == ExcludeIndex) continue;
+
+						float const DistanceSquared = FVector::DistSquared(SortedPositions[Slot], Location);
+						if (DistanceSquared >= MaxDistanceSquared) continue;
+
+						// Insertion into bounded sorted list, k is small.
+						int32 const Index = SortedIndices[Slot];
+						int32 Insert = OutIndices.Num();
+						while (Insert > 0 && (DistancesSquared[Insert - 1] > DistanceSquared || (DistancesSquared[Insert - 1] == DistanceSquared && OutIndices[Insert - 1] > Index)))
+						{
+							--Insert;
+						}
+						if (Insert >= MaxCount) continue;
+
+						if (OutIndices.Num() == MaxCount)
+						{
+							OutIndices.Pop(false);
+							DistancesSquared.Pop(false);
+						}
+						OutIndices.Insert(Index, Insert);
+						DistancesSquared.Insert(DistanceSquared, Insert);
+
+						// Full list, only closer positions than the farthest one can enter.
+						if (OutIndices.Num() == MaxCount)
+						{
+							MaxDistanceSquared = DistancesSquared.Last();
+						}
+					}
+				}
+			}
+		}
+	}
+}
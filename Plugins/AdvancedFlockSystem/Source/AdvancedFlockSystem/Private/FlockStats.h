@@ -0,0 +1,44 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Stats/Stats.h"
+
+DECLARE_STATS_GROUP(TEXT("Flock"), STATGROUP_Flock, STATCAT_Advanced);
+
+// Game thread.
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Tick"), STAT_FlockTick, STATGROUP_Flock, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Get Members Data"), STAT_FlockGetMembersData, STATGROUP_Flock, );
+// Game thread blocked on running step.
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Step Wait"), STAT_FlockStepWait, STATGROUP_Flock, );
+// Copy of game thread state into simulation before step.
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Snapshot Copy"), STAT_FlockSnapshotCopy, STATGROUP_Flock, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Instance Upload"), STAT_FlockInstanceUpload, STATGROUP_Flock, );
+
+// Worker threads.
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Step"), STAT_FlockStep, STATGROUP_Flock, );
+// One step of all flocks of a world, see UFlockSubsystem.
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Batch Step"), STAT_FlockBatchStep, STATGROUP_Flock, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Grid Build"), STAT_FlockGridBuild, STATGROUP_Flock, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Step Chunk"), STAT_FlockStepChunk, STATGROUP_Flock, );
+
+// Time of steering behaviors summed over all workers, only with Flock.DetailedStats 1.
+// Grid query of nearby flock mates, and one pass over them for align, cohesion and separate sums.
+DECLARE_FLOAT_COUNTER_STAT_EXTERN(TEXT("Neighbor Query ms"), STAT_FlockNeighborQueryTime, STATGROUP_Flock, );
+DECLARE_FLOAT_COUNTER_STAT_EXTERN(TEXT("Steering Accumulate ms"), STAT_FlockSteeringAccumulateTime, STATGROUP_Flock, );
+DECLARE_FLOAT_COUNTER_STAT_EXTERN(TEXT("Flee ms"), STAT_FlockFleeTime, STATGROUP_Flock, );
+DECLARE_FLOAT_COUNTER_STAT_EXTERN(TEXT("Avoidance ms"), STAT_FlockAvoidanceTime, STATGROUP_Flock, );
+DECLARE_FLOAT_COUNTER_STAT_EXTERN(TEXT("Aquarium ms"), STAT_FlockAquariumTime, STATGROUP_Flock, );
+DECLARE_FLOAT_COUNTER_STAT_EXTERN(TEXT("Interaction ms"), STAT_FlockInteractionTime, STATGROUP_Flock, );
+
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Members"), STAT_FlockMembers, STATGROUP_Flock, );
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Neighbors Visited"), STAT_FlockNeighborsVisited, STATGROUP_Flock, );
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Avoidance Triggers"), STAT_FlockAvoidanceTriggers, STATGROUP_Flock, );
+// Replicated flock payload sent by server in this frame, per connection. Without property and RPC headers.
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Net Payload Bytes"), STAT_FlockNetPayloadBytes, STATGROUP_Flock, );
+
+// Flock members in every simulation LOD, summed over all flock actors.
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Members LOD Near"), STAT_FlockMembersLODNear, STATGROUP_Flock, );
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Members LOD Mid"), STAT_FlockMembersLODMid, STATGROUP_Flock, );
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Members LOD Far"), STAT_FlockMembersLODFar, STATGROUP_Flock, );
@@ -0,0 +1,135 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#include "FlockSteering.h"
+#include "HAL/IConsoleManager.h"
+
+static TAutoConsoleVariable<int32> CVarFlockVectorizedSteering(
+	TEXT("Flock.VectorizedSteering"),
+	1,
+	TEXT("0 - scalar flock steering kernel, 1 - vectorized flock steering kernel."));
+
+// Add mates from Mates[0] to Mates[NumMates - 1] to OutSums.
+static FORCEINLINE void AccumulateMatesRange(const FVector4* Positions, const FVector4* Velocities, const int32* Mates, int32 NumMates,
+                                             const FVector& Location, FlockMatesSums& OutSums)
+{
+	for (int32 i = 0; i < NumMates; ++i)
+	{
+		FVector4 const& MatePosition = Positions[Mates[i]];
+		FVector4 const& MateVelocity = Velocities[Mates[i]];
+
+		FVector const Position(MatePosition.X, MatePosition.Y, MatePosition.Z);
+		OutSums.Position += Position;
+		OutSums.Velocity += FVector(MateVelocity.X, MateVelocity.Y, MateVelocity.Z);
+
+		// Normalized difference divided by distance.
+		FVector const Diff = Location - Position;
+		float const DistanceSquared = Diff.SizeSquared();
+		if (DistanceSquared > SMALL_NUMBER)
+		{
+			OutSums.Separation += Diff * (1.f / DistanceSquared);
+		}
+	}
+	OutSums.Num += NumMates;
+}
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS
+// XYZ of four vectors as one register per component.
+static FORCEINLINE void TransposeXYZ(const VectorRegister& A, const VectorRegister& B, const VectorRegister& C, const VectorRegister& D,
+                                     VectorRegister& OutX, VectorRegister& OutY, VectorRegister& OutZ)
+{
+	VectorRegister const AB01 = VectorShuffle(A, B, 0, 1, 0, 1);
+	VectorRegister const CD01 = VectorShuffle(C, D, 0, 1, 0, 1);
+	VectorRegister const AB23 = VectorShuffle(A, B, 2, 3, 2, 3);
+	VectorRegister const CD23 = VectorShuffle(C, D, 2, 3, 2, 3);
+
+	OutX = VectorShuffle(AB01, CD01, 0, 2, 0, 2);
+	OutY = VectorShuffle(AB01, CD01, 1, 3, 1, 3);
+	OutZ = VectorShuffle(AB23, CD23, 0, 2, 0, 2);
+}
+
+static FORCEINLINE float VectorHorizontalSum(const VectorRegister& Vec)
+{
+	MS_ALIGN(16) float Lanes[4] GCC_ALIGN(16);
+	VectorStoreAligned(Vec, Lanes);
+	return (Lanes[0] + Lanes[1]) + (Lanes[2] + Lanes[3]);
+}
+#endif
+
+void FlockSteering::AccumulateMates(const FVector4* Positions, const FVector4* Velocities, const int32* Mates, int32 NumMates,
+                                    const FVector& Location, FlockMatesSums& OutSums)
+{
+	OutSums = FlockMatesSums();
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS
+	VectorRegister const LocationX = VectorSetFloat1(Location.X);
+	VectorRegister const LocationY = VectorSetFloat1(Location.Y);
+	VectorRegister const LocationZ = VectorSetFloat1(Location.Z);
+	VectorRegister const MinDistanceSquared = VectorSetFloat1(SMALL_NUMBER);
+
+	VectorRegister PositionX = VectorZero();
+	VectorRegister PositionY = VectorZero();
+	VectorRegister PositionZ = VectorZero();
+	VectorRegister VelocityX = VectorZero();
+	VectorRegister VelocityY = VectorZero();
+	VectorRegister VelocityZ = VectorZero();
+	VectorRegister SeparationX = VectorZero();
+	VectorRegister SeparationY = VectorZero();
+	VectorRegister SeparationZ = VectorZero();
+
+	int32 MateID = 0;
+	for ( ; MateID + 4 <= NumMates; MateID += 4)
+	{
+		VectorRegister MateX, MateY, MateZ;
+		TransposeXYZ(VectorLoadAligned(&Positions[Mates[MateID]]), VectorLoadAligned(&Positions[Mates[MateID + 1]]),
+		             VectorLoadAligned(&Positions[Mates[MateID + 2]]), VectorLoadAligned(&Positions[Mates[MateID + 3]]),
+		             MateX, MateY, MateZ);
+
+		VectorRegister MateVelocityX, MateVelocityY, MateVelocityZ;
+		TransposeXYZ(VectorLoadAligned(&Velocities[Mates[MateID]]), VectorLoadAligned(&Velocities[Mates[MateID + 1]]),
+		             VectorLoadAligned(&Velocities[Mates[MateID + 2]]), VectorLoadAligned(&Velocities[Mates[MateID + 3]]),
+		             MateVelocityX, MateVelocityY, MateVelocityZ);
+
+		// Cohesion and alignment.
+		PositionX = VectorAdd(PositionX, MateX);
+		PositionY = VectorAdd(PositionY, MateY);
+		PositionZ = VectorAdd(PositionZ, MateZ);
+		VelocityX = VectorAdd(VelocityX, MateVelocityX);
+		VelocityY = VectorAdd(VelocityY, MateVelocityY);
+		VelocityZ = VectorAdd(VelocityZ, MateVelocityZ);
+
+		// Separation, skip mates at the same location.
+		VectorRegister const DiffX = VectorSubtract(LocationX, MateX);
+		VectorRegister const DiffY = VectorSubtract(LocationY, MateY);
+		VectorRegister const DiffZ = VectorSubtract(LocationZ, MateZ);
+		VectorRegister const DistanceSquared = VectorMultiplyAdd(DiffX, DiffX, VectorMultiplyAdd(DiffY, DiffY, VectorMultiply(DiffZ, DiffZ)));
+		VectorRegister const InvDistanceSquared = VectorSelect(VectorCompareGT(DistanceSquared, MinDistanceSquared), VectorReciprocalAccurate(DistanceSquared), VectorZero());
+
+		SeparationX = VectorMultiplyAdd(DiffX, InvDistanceSquared, SeparationX);
+		SeparationY = VectorMultiplyAdd(DiffY, InvDistanceSquared, SeparationY);
+		SeparationZ = VectorMultiplyAdd(DiffZ, InvDistanceSquared, SeparationZ);
+	}
+
+	OutSums.Position = FVector(VectorHorizontalSum(PositionX), VectorHorizontalSum(PositionY), VectorHorizontalSum(PositionZ));
+	OutSums.Velocity = FVector(VectorHorizontalSum(VelocityX), VectorHorizontalSum(VelocityY), VectorHorizontalSum(VelocityZ));
+	OutSums.Separation = FVector(VectorHorizontalSum(SeparationX), VectorHorizontalSum(SeparationY), VectorHorizontalSum(SeparationZ));
+	OutSums.Num = MateID;
+
+	// Remainder of 4.
+	AccumulateMatesRange(Positions, Velocities, Mates + MateID, NumMates - MateID, Location, OutSums);
+#else
+	AccumulateMatesRange(Positions, Velocities, Mates, NumMates, Location, OutSums);
+#endif
+}
+
+void FlockSteering::AccumulateMatesScalar(const FVector4* Positions, const FVector4* Velocities, const int32* Mates, int32 NumMates,
+                                          const FVector& Location, FlockMatesSums& OutSums)
+{
+	OutSums = FlockMatesSums();
+
+	AccumulateMatesRange(Positions, Velocities, Mates, NumMates, Location, OutSums);
+}
+
+bool FlockSteering::UseVectorizedSteering()
+{
+	return CVarFlockVectorizedSteering.GetValueOnAnyThread() != 0;
+}
@@ -0,0 +1,167 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#include "FlockSubsystem.h"
+#include "FlockSystemActor.h"
+#include "Algo/BinarySearch.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+#include "FlockStats.h"
+
+void UFlockSubsystem::Deinitialize()
+{
+	EnsureCompletion();
+	FlockActors.Reset();
+	BatchSimulations.Reset();
+	IndexSimulations.Reset();
+
+	Super::Deinitialize();
+}
+
+void UFlockSubsystem::RegisterFlock(AFlockSystemActor* FlockActor)
+{
+	FlockActors.AddUnique(FlockActor);
+}
+
+void UFlockSubsystem::UnregisterFlock(AFlockSystemActor* FlockActor)
+{
+	// Running batch may read the flock from shared index, even if it does not step it.
+	EnsureCompletion();
+	FlockActors.Remove(FlockActor);
+}
+
+void UFlockSubsystem::EnsureCompletion()
+{
+	if (BatchTask.IsValid() && !BatchTask->IsComplete())
+	{
+		SCOPE_CYCLE_COUNTER(STAT_FlockStepWait);
+		FTaskGraphInterface::Get().WaitUntilTaskCompletes(BatchTask);
+	}
+	BatchTask = nullptr;
+}
+
+void UFlockSubsystem::Tick(float DeltaTime)
+{
+	// Flocks of the running batch can't queue, the rest waits for next frame.
+	if (BatchTask.IsValid() && !BatchTask->IsComplete()) return;
+
+	BatchSimulations.Reset();
+	BatchFlockIndices.Reset();
+	IndexSimulations.Reset();
+	IndexFlockTypes.Reset();
+	for (AFlockSystemActor* FlockActor : FlockActors)
+	{
+		FlockSimulation* Simulation = FlockActor ? FlockActor->GetSimulation() : nullptr;
+		if (!Simulation) continue;
+
+		// Flocks not stepped in this batch are idle, their last published members are safe to read.
+		if (Simulation->IsStepQueued())
+		{
+			BatchSimulations.Add(Simulation);
+			BatchFlockIndices.Add(IndexSimulations.Num());
+		}
+		IndexSimulations.Add(Simulation);
+		IndexFlockTypes.Add(FlockActor->FlockParameters.FlockType);
+	}
+
+	if (BatchSimulations.Num() == 0) return;
+
+	BatchTask = FFunctionGraphTask::CreateAndDispatchWhenReady([this]()
+	{
+		StepBatch();
+	}, TStatId(), nullptr, ENamedThreads::AnyHiPriThreadNormalTask);
+
+	// Flocks see the batch as their running step.
+	for (FlockSimulation* Simulation : BatchSimulations)
+	{
+		Simulation->SetBatchTask(BatchTask);
+	}
+}
+
+ETickableTickType UFlockSubsystem::GetTickableTickType() const
+{
+	return HasAnyFlags(RF_ClassDefaultObject) ? ETickableTickType::Never : ETickableTickType::Conditional;
+}
+
+bool UFlockSubsystem::IsTickable() const
+{
+	return FlockActors.Num() > 0;
+}
+
+TStatId UFlockSubsystem::GetStatId() const
+{
+	RETURN_QUICK_DECLARE_CYCLE_STAT(UFlockSubsystem, STATGROUP_Tickables);
+}
+
+void UFlockSubsystem::StepBatch()
+{
+	SCOPE_CYCLE_COUNTER(STAT_FlockBatchStep);
+	TRACE_CPUPROFILER_EVENT_SCOPE(FlockBatchStep);
+
+	int32 const NumSimulations = BatchSimulations.Num();
+	int32 MaxSubsteps = 0;
+
+	// Shared index of members at step start, cell size is the largest interaction radius.
+	float InteractionRadius = 0.f;
+	for (FlockSimulation* Simulation : BatchSimulations)
+	{
+		InteractionRadius = FMath::Max(InteractionRadius, Simulation->GetInteractionRadius());
+	}
+	bool const bUseSharedIndex = InteractionRadius > 0.f && IndexSimulations.Num() > 1;
+	if (bUseSharedIndex)
+	{
+		SharedIndex.Reset();
+		for (FlockSimulation* Simulation : IndexSimulations)
+		{
+			SharedIndex.AddFlock(Simulation->StepBuffers.GetLastPublished().Members);
+		}
+		SharedIndex.Build(InteractionRadius);
+	}
+
+	BatchNumChunks.SetNumUninitialized(NumSimulations, false);
+	for (int32 SimulationIndex = 0; SimulationIndex < NumSimulations; ++SimulationIndex)
+	{
+		BatchSimulations[SimulationIndex]->SetSharedIndex(bUseSharedIndex ? &SharedIndex : nullptr, IndexFlockTypes, BatchFlockIndices[SimulationIndex]);
+		BatchNumChunks[SimulationIndex] = BatchSimulations[SimulationIndex]->BeginStep();
+		MaxSubsteps = FMath::Max(MaxSubsteps, BatchSimulations[SimulationIndex]->GetNumSubsteps());
+	}
+
+	for (int32 Substep = 0; Substep < MaxSubsteps; ++Substep)
+	{
+		// Flocks with fewer substeps are done.
+		SubstepSimulations.Reset();
+		SubstepChunkStarts.Reset();
+		int32 NumChunks = 0;
+		for (int32 SimulationIndex = 0; SimulationIndex < NumSimulations; ++SimulationIndex)
+		{
+			if (Substep >= BatchSimulations[SimulationIndex]->GetNumSubsteps()) continue;
+
+			SubstepSimulations.Add(SimulationIndex);
+			SubstepChunkStarts.Add(NumChunks);
+			NumChunks += BatchNumChunks[SimulationIndex];
+		}
+		SubstepChunkStarts.Add(NumChunks);
+
+		// Grids of all flocks in parallel.
+		ParallelFor(SubstepSimulations.Num(), [this, Substep](int32 Index)
+		{
+			BatchSimulations[SubstepSimulations[Index]]->BeginSubstep(Substep);
+		}, EParallelForFlags::Unbalanced);
+
+		// Chunks of all flocks in one ParallelFor, so small flocks share workers instead of each waiting for its own.
+		ParallelFor(NumChunks, [this](int32 ChunkIndex)
+		{
+			// Last flock starting at or before the chunk. Flocks without chunks have the same start as the next one.
+			int32 const Index = Algo::UpperBound(SubstepChunkStarts, ChunkIndex) - 1;
+			BatchSimulations[SubstepSimulations[Index]]->RunChunk(ChunkIndex - SubstepChunkStarts[Index]);
+		}, EParallelForFlags::Unbalanced);
+
+		for (int32 SimulationIndex : SubstepSimulations)
+		{
+			BatchSimulations[SimulationIndex]->EndSubstep();
+		}
+	}
+
+	for (FlockSimulation* Simulation : BatchSimulations)
+	{
+		Simulation->EndStep();
+	}
+}
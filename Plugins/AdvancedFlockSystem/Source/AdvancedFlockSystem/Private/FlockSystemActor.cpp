@@ -7,8 +7,78 @@
 #include "Components/SphereComponent.h"
 #include "Components/BoxComponent.h"
 #include "Kismet/GameplayStatics.h"
-#include "Runtime/Core/Public/HAL/RunnableThread.h"
 #include "TimerManager.h"
+#include "HAL/IConsoleManager.h"
+#include "GameFramework/PlayerController.h"
+#include "GameFramework/PlayerState.h"
+#include "Engine/World.h"
+#include "Engine/StaticMesh.h"
+#include "Camera/PlayerCameraManager.h"
+#include "SceneManagement.h"
+#include "HAL/ThreadSafeBool.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+#include "FlockStats.h"
+#include "FlockSubsystem.h"
+#include "FlockSnapshot.h"
+#include "Misc/Paths.h"
+#include "Net/UnrealNetwork.h"
+#include "PhysicsEngine/BodySetup.h"
+#include "Algo/Sort.h"
+
+DEFINE_LOG_CATEGORY_STATIC(LogFlockSystem, Log, All);
+
+DEFINE_STAT(STAT_FlockTick);
+DEFINE_STAT(STAT_FlockGetMembersData);
+DEFINE_STAT(STAT_FlockStepWait);
+DEFINE_STAT(STAT_FlockSnapshotCopy);
+DEFINE_STAT(STAT_FlockInstanceUpload);
+DEFINE_STAT(STAT_FlockStep);
+DEFINE_STAT(STAT_FlockBatchStep);
+DEFINE_STAT(STAT_FlockGridBuild);
+DEFINE_STAT(STAT_FlockStepChunk);
+DEFINE_STAT(STAT_FlockNeighborQueryTime);
+DEFINE_STAT(STAT_FlockSteeringAccumulateTime);
+DEFINE_STAT(STAT_FlockFleeTime);
+DEFINE_STAT(STAT_FlockAvoidanceTime);
+DEFINE_STAT(STAT_FlockAquariumTime);
+DEFINE_STAT(STAT_FlockInteractionTime);
+DEFINE_STAT(STAT_FlockMembers);
+DEFINE_STAT(STAT_FlockNeighborsVisited);
+DEFINE_STAT(STAT_FlockAvoidanceTriggers);
+DEFINE_STAT(STAT_FlockNetPayloadBytes);
+DEFINE_STAT(STAT_FlockMembersLODNear);
+DEFINE_STAT(STAT_FlockMembersLODMid);
+DEFINE_STAT(STAT_FlockMembersLODFar);
+
+static TAutoConsoleVariable<int32> CVarFlockStepChunkSize(
+	TEXT("Flock.StepChunkSize"),
+	64,
+	TEXT("Number of flock members in one ParallelFor chunk of flock step."));
+
+static TAutoConsoleVariable<int32> CVarFlockDetailedStats(
+	TEXT("Flock.DetailedStats"),
+	0,
+	TEXT("Time every steering behavior of every flock member for stat Flock. Adds timer overhead to flock step."));
+
+// Adds cycles of its scope to Cycles. Does nothing for null Cycles.
+struct FlockBehaviorTimer
+{
+	explicit FlockBehaviorTimer(uint64* InCycles)
+		: Cycles(InCycles), StartCycles(InCycles ? FPlatformTime::Cycles64() : 0)
+	{
+	}
+
+	~FlockBehaviorTimer()
+	{
+		if (Cycles)
+		{
+			*Cycles += FPlatformTime::Cycles64() - StartCycles;
+		}
+	}
+
+	uint64* Cycles;
+	uint64 StartCycles;
+};
 
 AFlockSystemActor::AFlockSystemActor()
 {
@@ -36,188 +106,385 @@ AFlockSystemActor::AFlockSystemActor()
 	StaticMeshInstanceComponent->SetGenerateOverlapEvents(false);
 }
 
-FlockThread::FlockThread(AActor* NewActor)
+// Runs Step of one flock simulation.
+class FlockStepTask
 {
-	Kill = false;
-	Pause = false;
+public:
 
-	//Initialize FEvent (as a cross platform (Confirmed Mac/Windows))
-	Semaphore = FGenericPlatformProcess::GetSynchEventFromPool(false);
+	FlockStepTask(FlockSimulation& InSimulation, ENamedThreads::Type InThread)
+		: Simulation(InSimulation), Thread(InThread)
+	{
+	}
 
-	EThreadPriority ThreadPriority;
+	ENamedThreads::Type GetDesiredThread() const { return Thread; }
+	static ESubsequentsMode::Type GetSubsequentsMode() { return ESubsequentsMode::TrackSubsequents; }
+	FORCEINLINE TStatId GetStatId() const { RETURN_QUICK_DECLARE_CYCLE_STAT(FlockStepTask, STATGROUP_TaskGraphTasks); }
 
-	switch (FlockParametersTHR.ThreadPriority)
+	void DoTask(ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent)
 	{
-	case EPriority::Normal:
-		ThreadPriority = TPri_Normal;
-		break;
-	case EPriority::Highest:
-		ThreadPriority = TPri_Highest;
-		break;
-	case EPriority::Lowest:
-		ThreadPriority = TPri_Lowest;
-		break;
-	case EPriority::AboveNormal:
-		ThreadPriority = TPri_AboveNormal;
-		break;
-	case EPriority::BelowNormal:
-		ThreadPriority = TPri_BelowNormal;
-		break;
-	case EPriority::SlightlyBelowNormal:
-		ThreadPriority = TPri_SlightlyBelowNormal;
-		break;
-	case EPriority::TimeCritical:
-		ThreadPriority = TPri_TimeCritical;
-		break;
-
-	default:
-		ThreadPriority = TPri_AboveNormal;
-		break;
+		Simulation.Step();
 	}
 
-	Thread = FRunnableThread::Create(this, (TEXT("%s_FSomeRunnable"), *NewActor->GetName()), 0, ThreadPriority);
+private:
+
+	FlockSimulation& Simulation;
+	ENamedThreads::Type Thread;
+};
+
+FlockSimulation::FlockSimulation()
+{
+}
+
+FlockSimulation::~FlockSimulation()
+{
+	EnsureCompletion();
+}
+
+bool FlockSimulation::StartStep(float DeltaTime, int32 NumSubsteps)
+{
+	if (IsStepRunning()) return false;
+
+	StepDeltaTime = DeltaTime;
+	StepNumSubsteps = FMath::Max(1, NumSubsteps);
+
+	// Own task type instead of a function task, which allocates its function every step.
+	StepTask = TGraphTask<FlockStepTask>::CreateTask().ConstructAndDispatchWhenReady(*this, StepTaskThread);
+
+	return true;
 }
 
-FlockThread::~FlockThread()
+bool FlockSimulation::IsStepRunning() const
 {
-	if (Semaphore)
+	return bStepQueued || (StepTask.IsValid() && !StepTask->IsComplete());
+}
+
+void FlockSimulation::EnsureCompletion()
+{
+	// Queued step has no task yet, it stays queued.
+	if (StepTask.IsValid() && !StepTask->IsComplete())
 	{
-		//Cleanup the FEvent
-		FGenericPlatformProcess::ReturnSynchEventToPool(Semaphore);
-		Semaphore = nullptr;
+		SCOPE_CYCLE_COUNTER(STAT_FlockStepWait);
+		FTaskGraphInterface::Get().WaitUntilTaskCompletes(StepTask);
 	}
+	StepTask = nullptr;
+}
 
-	if (Thread)
+void FlockSimulation::Step()
+{
+	SCOPE_CYCLE_COUNTER(STAT_FlockStep);
+	TRACE_CPUPROFILER_EVENT_SCOPE(FlockStep);
+
+	int32 const NumChunks = BeginStep();
+
+	for (int32 Substep = 0; Substep < StepNumSubsteps; ++Substep)
 	{
-		//Cleanup the worker thread
-		delete Thread;
-		Thread = nullptr;
+		BeginSubstep(Substep);
+
+		ParallelFor(NumChunks, [this](int32 ChunkIndex)
+		{
+			RunChunk(ChunkIndex);
+		}, StepParallelForFlags);
+
+		EndSubstep();
 	}
+
+	EndStep();
 }
 
-void FlockThread::EnsureCompletion()
+void FlockSimulation::QueueStep(float DeltaTime, int32 NumSubsteps)
 {
-	Stop();
+	if (IsStepRunning()) return;
 
-	if (Thread)
+	StepDeltaTime = DeltaTime;
+	StepNumSubsteps = FMath::Max(1, NumSubsteps);
+	bStepQueued = true;
+}
+
+void FlockSimulation::SetBatchTask(const FGraphEventRef& BatchTask)
+{
+	StepTask = BatchTask;
+	bStepQueued = false;
+}
+
+int32 FlockSimulation::BeginStep()
+{
+	StepStartTime = FPlatformTime::Seconds();
+	bDetailedStats = CVarFlockDetailedStats.GetValueOnAnyThread() != 0;
+
+	FlockMemberStore const& InputMembers = StepBuffers.GetLastPublished().Members;
+	int32 const NumMembers = InputMembers.Num();
+
+	NextStepResult = &StepBuffers.GetWriteBuffer();
+	NextStepResult->Members.SetNumUninitialized(NumMembers);
+	NextStepResult->PreviousPositions.SetNumUninitialized(NumMembers, false);
+	NextStepResult->PreviousOrientations.SetNumUninitialized(NumMembers, false);
+
+	// Clear attacked actors 
+	NextStepResult->AttackedActors.Reset();
+
+	if (StepNumSubsteps > 1)
 	{
-		Thread->WaitForCompletion();
+		SubstepMembers.SetNumUninitialized(NumMembers);
 	}
+
+	// Small chunks, so idle workers take chunks of busy ones.
+	StepChunkSize = FMath::Max(1, CVarFlockStepChunkSize.GetValueOnAnyThread());
+	StepNumChunks = FMath::DivideAndRoundUp(NumMembers, StepChunkSize);
+
+	// Only grow, so scratch memory of chunks is never freed and allocated again.
+	if (ChunkScratches.Num() < StepNumChunks)
+	{
+		ChunkScratches.SetNum(StepNumChunks);
+	}
+
+	// Step from the last published members. Substeps ping pong between SubstepMembers and write buffer, the last one writes into write buffer.
+	StepMembers = &InputMembers;
+
+	if (RecorderTHR.IsValid())
+	{
+		RecorderTHR->BeginFrame(StepNumChunks, NumMembers);
+	}
+
+	return StepNumChunks;
 }
 
-void FlockThread::PauseThread()
+void FlockSimulation::BeginSubstep(int32 Substep)
 {
-	Pause = true;
+	bLastSubstep = Substep == StepNumSubsteps - 1;
+	NextMembers = (StepNumSubsteps - 1 - Substep) % 2 == 0 ? &NextStepResult->Members : &SubstepMembers;
+
+	// Neighbor search over the read only input of this substep.
+	SCOPE_CYCLE_COUNTER(STAT_FlockGridBuild);
+	TRACE_CPUPROFILER_EVENT_SCOPE(FlockGridBuild);
+	// Nearest mates search stops at smaller cells in dense clusters.
+	float const CellSize = FlockParametersTHR.MaxFlockMates > 0 ? FlockParametersTHR.FlockMateAwarenessRadius * 0.5f : FlockParametersTHR.FlockMateAwarenessRadius;
+	Grid.Build(StepMembers->Positions.GetData(), StepMembers->Num(), CellSize, StepMembers->Flags.GetData(), FlockMemberFlags::Active);
 }
 
-void FlockThread::ContinueThread()
+void FlockSimulation::RunChunk(int32 ChunkIndex)
 {
-	Pause = false;
+	// Insights shows chunks on the track of the worker thread that ran them.
+	SCOPE_CYCLE_COUNTER(STAT_FlockStepChunk);
+	TRACE_CPUPROFILER_EVENT_SCOPE(FlockStepChunk);
+
+	FlockChunkScratch& Scratch = ChunkScratches[ChunkIndex];
+	Scratch.AttackedActors.Reset();
+	FMemory::Memzero(Scratch.NumMembersInLOD);
+
+	int32 const FirstMember = ChunkIndex * StepChunkSize;
+	int32 const LastMember = FMath::Min(FirstMember + StepChunkSize, StepMembers->Num());
+	StepChunk(FirstMember, LastMember, Scratch);
 
-	if (Semaphore)
+	// Encoded while the chunk is in cache, in parallel with other chunks.
+	if (bLastSubstep && RecorderTHR.IsValid())
 	{
-		//Here is a FEvent signal "Trigger()" -> it will wake up the thread.
-		Semaphore->Trigger();
+		RecorderTHR->EncodeChunk(ChunkIndex, *NextMembers, FirstMember, LastMember);
 	}
 }
 
-bool FlockThread::Init()
+void FlockSimulation::EndSubstep()
 {
-	return true;
+	for (int32 ChunkIndex = 0; ChunkIndex < StepNumChunks; ++ChunkIndex)
+	{
+		NextStepResult->AttackedActors.Append(ChunkScratches[ChunkIndex].AttackedActors);
+	}
+
+	StepMembers = NextMembers;
+	++SubstepCounter;
 }
 
-uint32 FlockThread::Run()
+void FlockSimulation::EndStep()
 {
-	//Initial wait before starting
-	FPlatformProcess::Sleep(FMath::RandRange(0.05f, 0.5f));
+	int32 const NumChunks = StepNumChunks;
+
+	NextStepResult->StepNumber = int32(SubstepCounter);
 
-	ThreadDeltaTime = 0.f;
+	// Spawned and removed members show up in this step result.
+	ApplyMemberCommands();
 
-	while (!Kill)
+	for (int32 LOD = 0; LOD < FlockLOD::Num; ++LOD)
 	{
-		if (Pause)
+		NextStepResult->NumMembersInLOD[LOD] = 0;
+		for (int32 ChunkIndex = 0; ChunkIndex < NumChunks; ++ChunkIndex)
 		{
-			//FEvent->Wait(); will "sleep" the thread until it will get a signal "Trigger()"
-			Semaphore->Wait();
+			NextStepResult->NumMembersInLOD[LOD] += ChunkScratches[ChunkIndex].NumMembersInLOD[LOD];
+		}
+	}
 
-			if (Kill)
+	// Stats of all substeps, chunk counters are cleared here for the next step.
+	NextStepResult->NumNeighborsVisited = 0;
+	NextStepResult->NumAvoidanceTriggers = 0;
+	for (int32 ChunkIndex = 0; ChunkIndex < NumChunks; ++ChunkIndex)
+	{
+		FlockChunkScratch& Scratch = ChunkScratches[ChunkIndex];
+		NextStepResult->NumNeighborsVisited += Scratch.NumNeighborsVisited;
+		NextStepResult->NumAvoidanceTriggers += Scratch.NumAvoidanceTriggers;
+		Scratch.NumNeighborsVisited = 0;
+		Scratch.NumAvoidanceTriggers = 0;
+	}
+	for (int32 Behavior = 0; Behavior < FlockBehavior::Num; ++Behavior)
+	{
+		uint64 Cycles = 0;
+		for (int32 ChunkIndex = 0; ChunkIndex < NumChunks; ++ChunkIndex)
+		{
+			Cycles += ChunkScratches[ChunkIndex].BehaviorCycles[Behavior];
+			ChunkScratches[ChunkIndex].BehaviorCycles[Behavior] = 0;
+		}
+		NextStepResult->BehaviorTimes[Behavior] = float(FPlatformTime::ToMilliseconds64(Cycles));
+	}
+
+	NextStepResult->StepTime = float(FPlatformTime::Seconds() - StepStartTime);
+
+	if (RecorderTHR.IsValid())
+	{
+		RecorderTHR->EndFrame(StepDeltaTime * StepNumSubsteps, NextStepResult->StepTime);
+	}
+
+	// Publish finished step with one atomic swap. Game thread takes it without lock.
+	StepBuffers.Publish();
+	StepMembers = nullptr;
+	NextMembers = nullptr;
+	NextStepResult = nullptr;
+}
+
+void FlockSimulation::StepChunk(int32 FirstMember, int32 LastMember, FlockChunkScratch& Scratch)
+{
+	FlockMemberStore& OutMembers = *NextMembers;
+	FlockMatesSums MatesSums;
+	// Behavior timers write here only with detailed stats.
+	uint64* BehaviorCycles = bDetailedStats ? Scratch.BehaviorCycles : nullptr;
+
+	for (int32 FlockMemberID = FirstMember; FlockMemberID < LastMember; ++FlockMemberID)
+	{
+		// Free slot, keep it as it is.
+		if (!StepMembers->HasFlag(FlockMemberID, FlockMemberFlags::Active))
+		{
+			OutMembers.CopyMember(FlockMemberID, *StepMembers, FlockMemberID);
+			if (bLastSubstep)
 			{
-				return 0;
+				NextStepResult->PreviousPositions[FlockMemberID] = StepMembers->Positions[FlockMemberID];
+				NextStepResult->PreviousOrientations[FlockMemberID] = StepMembers->Orientations[FlockMemberID];
 			}
+			continue;
 		}
-		else
+
+		FVector const FlockMemberLocation = StepMembers->GetLocation(FlockMemberID);
+		FVector4 WanderTarget = StepMembers->WanderTargets[FlockMemberID];
+		FRandomStream Random(StepMembers->RandomSeeds[FlockMemberID]);
+
+		FlockLOD::Type const LOD = GetMemberLOD(FlockMemberLocation);
+		if (bLastSubstep)
 		{
-			uint64 const TimePlatform = FPlatformTime::Cycles64();
+			++Scratch.NumMembersInLOD[LOD];
+		}
 
-			TArray<FlockMemberData> FlockMembersArr = FlockThreadMembersArr;
+		// Members of one LOD are spread over steps of its interval.
+		int32 const StepInterval = GetLODStepInterval(LOD);
+		bool const bFullUpdate = StepInterval <= 1 || (SubstepCounter + FlockMemberID) % StepInterval == 0;
+		bool const bFarLOD = LOD == FlockLOD::Far;
+		// Time since the last full update of this member.
+		float const MemberDeltaTime = StepDeltaTime * StepInterval;
 
-			for (int32 FlockMemberID = 0; FlockMemberID < FlockMembersArr.Num(); ++FlockMemberID)
-			{				
-				bool bIsAvoidance(false);
-				FlockMemberData& FlockMember = FlockMembersArr[FlockMemberID];
+		FVector NewLocation;
+		FVector Velocity;
+		FQuat Orientation;
 
-				// Clear attacked actors 
-				FlockMember.AttackedActors.Empty();
+		if (!bFullUpdate)
+		{
+			// Dead reckoning, keep velocity and orientation of the last full update.
+			Velocity = StepMembers->GetVelocity(FlockMemberID);
+			Orientation = StepMembers->Orientations[FlockMemberID];
+			NewLocation = FMath::VInterpTo(FlockMemberLocation, FlockMemberLocation + Velocity, StepDeltaTime, FlockParametersTHR.MoveSpeedInterpInThread);
 
-				FVector FollowVec = FVector::ZeroVector;
-				FVector CohesionVec = FVector::ZeroVector;
-				FVector AlignmentVec = FVector::ZeroVector;
-				FVector SeparationVec = FVector::ZeroVector;
-				FVector FleeVec = FVector::ZeroVector;
-				FVector NewVelocity = FVector::ZeroVector;
+			if (StepMembers->HasFlag(FlockMemberID, FlockMemberFlags::Leader))
+			{
+				WanderTarget.W += StepDeltaTime;
+			}
+		}
+		else
+		{
+			bool bIsAvoidance(false);
 
-				FVector const FlockMemberLocation = FlockMember.Transform.GetLocation();
+			FVector FollowVec = FVector::ZeroVector;
+			FVector CohesionVec = FVector::ZeroVector;
+			FVector AlignmentVec = FVector::ZeroVector;
+			FVector SeparationVec = FVector::ZeroVector;
+			FVector FleeVec = FVector::ZeroVector;
+			FVector NewVelocity = FVector::ZeroVector;
 
+			// Follow to Leader
+			if (StepMembers->HasFlag(FlockMemberID, FlockMemberFlags::Leader))
+			{
+				NewVelocity += SteeringWander(FlockMemberID, WanderTarget, Random);
 
-				// Follow to Leader
-				if (FlockMember.bIsFlockLeader)
+				WanderTarget.W += StepDeltaTime;
+			}
+			else
+			{
+				if (FlockParametersTHR.FollowScale > 0.0f)
 				{
-					NewVelocity += SteeringWander(FlockMember);
+					// Leader following (seek)
+					FollowVec = SteeringFollow(FlockMemberID, GroupLeaders[MemberLeaderGroups[FlockMemberID]], Scratch.AttackedActors) * FlockParametersTHR.FollowScale;
+				}
 
-					FlockMember.ElapsedTimeSinceLastWander += ThreadDeltaTime;
+				// Other forces need nearby flock mates. Align, cohesion and separate only divide the sums, their cost is in accumulate.
+				{
+					FlockBehaviorTimer Timer(BehaviorCycles ? &BehaviorCycles[FlockBehavior::NeighborQuery] : nullptr);
+					GetNearbyFlockMates(FlockMemberID, Scratch.Mates);
 				}
-				else
 				{
-					if (FlockParametersTHR.FollowScale > 0.0f)
-					{
-						// Leader following (seek)
-						FollowVec = SteeringFollow(FlockMember, 0) * FlockParametersTHR.FollowScale;
-					}
-
-					// Other forces need nearby flock mates
-					TArray<int32> Mates = GetNearbyFlockMates(FlockMemberID);
+					FlockBehaviorTimer Timer(BehaviorCycles ? &BehaviorCycles[FlockBehavior::SteeringAccumulate] : nullptr);
+					AccumulateFlockMates(FlockMemberID, Scratch.Mates, MatesSums);
+				}
+				Scratch.NumNeighborsVisited += Scratch.Mates.Num();
 
-					if (FlockParametersTHR.CohesionScale > 0.0f)
-					{
-						// Cohesion - staying near nearby flock mates
-						CohesionVec = SteeringCohesion(FlockMember, Mates) * FlockParametersTHR.CohesionScale;
-					}
+				if (FlockParametersTHR.CohesionScale > 0.0f)
+				{
+					// Cohesion - staying near nearby flock mates
+					CohesionVec = SteeringCohesion(FlockMemberID, MatesSums) * FlockParametersTHR.CohesionScale;
+				}
 
-					if (FlockParametersTHR.AlignScale > 0.0f)
-					{
-						// Alignment =  aligning with the heading of nearby flock mates
-						AlignmentVec = SteeringAlign(FlockMember, Mates) * FlockParametersTHR.AlignScale;
-					}
+				if (!bFarLOD && FlockParametersTHR.AlignScale > 0.0f)
+				{
+					// Alignment =  aligning with the heading of nearby flock mates
+					AlignmentVec = SteeringAlign(FlockMemberID, MatesSums) * FlockParametersTHR.AlignScale;
+				}
 
-					if (FlockParametersTHR.SeparationScale > 0.0f)
-					{
-						// Separation = trying to not get too close to flock mates
-						SeparationVec = SteeringSeparate(FlockMember, Mates) * FlockParametersTHR.SeparationScale;
-					}
+				if (!bFarLOD && FlockParametersTHR.SeparationScale > 0.0f)
+				{
+					// Separation = trying to not get too close to flock mates
+					SeparationVec = SteeringSeparate(FlockMemberID, MatesSums) * FlockParametersTHR.SeparationScale;
 				}
+			}
+			// Far members only follow and keep cohesion.
+			if (!bFarLOD)
+			{
 				// Flee = running away from enemies!
 				if (!FlockParametersTHR.bFollowToPawn && FlockParametersTHR.FleeScale > 0.0f)
 				{
-					FleeVec = SteeringFlee(FlockMember) * FlockParametersTHR.FleeScale;
+					FlockBehaviorTimer Timer(BehaviorCycles ? &BehaviorCycles[FlockBehavior::Flee] : nullptr);
+					FleeVec = SteeringFlee(FlockMemberID) * FlockParametersTHR.FleeScale;
 					if (FleeVec != FVector::ZeroVector)
 					{
 						bIsAvoidance = true;
 					}
 				}
-				// Flee = running away from primitive object collision from root component!
-				if (FlockParametersTHR.FleeScaleAvoidance > 0.f && AllOverlappingComponentsArrTHR.Num() > 0 && FlockParametersTHR.bAutoAddComponentsInArray)
+				// Flee, chase and avoid = reacting on members of other flocks!
+				if (SharedIndexTHR)
+				{
+					FlockBehaviorTimer Timer(BehaviorCycles ? &BehaviorCycles[FlockBehavior::Interaction] : nullptr);
+					FVector const InteractionVec = SteeringInteraction(FlockMemberID);
+					if (InteractionVec != FVector::ZeroVector)
+					{
+						bIsAvoidance = true;
+						FleeVec += InteractionVec;
+					}
+				}
+				// Flee = running away from static obstacles of avoidance field!
+				if (FlockParametersTHR.FleeScaleAvoidance > 0.f && AvoidanceFieldTHR.IsValid())
 				{
-					FVector AvoidVec = SteeringAvoidanceComponent(FlockMember) * FlockParametersTHR.FleeScaleAvoidance;
+					FlockBehaviorTimer Timer(BehaviorCycles ? &BehaviorCycles[FlockBehavior::Avoidance] : nullptr);
+					FVector AvoidVec = SteeringAvoidanceField(FlockMemberID) * FlockParametersTHR.FleeScaleAvoidance;
 
 					if (AvoidVec != FVector::ZeroVector)
 					{
@@ -225,11 +492,11 @@ uint32 FlockThread::Run()
 						FleeVec = AvoidVec;
 					}
 				}
-
-				// Flee = running away from primitive object collision from root component!
-				if (FlockParametersTHR.FleeScaleAvoidance > 0.f && AvoidanceActorRootArrTHR.Num() > 0)
+				// Flee = running away from moving obstacles!
+				if (FlockParametersTHR.FleeScaleAvoidance > 0.f && WorldSnapshotTHR.MovingObstacles.Num() > 0)
 				{
-					FVector AvoidVec = SteeringAvoidance(FlockMember) * FlockParametersTHR.FleeScaleAvoidance;
+					FlockBehaviorTimer Timer(BehaviorCycles ? &BehaviorCycles[FlockBehavior::Avoidance] : nullptr);
+					FVector AvoidVec = SteeringMovingObstacles(FlockMemberID) * FlockParametersTHR.FleeScaleAvoidance;
 
 					if (AvoidVec != FVector::ZeroVector)
 					{
@@ -240,10 +507,11 @@ uint32 FlockThread::Run()
 				// Avoidance Aquarium. 
 				if (FlockParametersTHR.FleeScaleAquarium > 0.f && FlockParametersTHR.bUseAquarium)
 				{
-					if (!UKismetMathLibrary::IsPointInBox(FlockMemberLocation, BoxComponentRef->GetComponentLocation(), BoxComponentRef->GetScaledBoxExtent()))
+					FlockBehaviorTimer Timer(BehaviorCycles ? &BehaviorCycles[FlockBehavior::Aquarium] : nullptr);
+					if (!UKismetMathLibrary::IsPointInBox(FlockMemberLocation, WorldSnapshotTHR.AquariumCenter, WorldSnapshotTHR.AquariumExtent))
 					{
 						// Flee = running away from Aquarium wall!
-						FleeVec = SteeringAquarium(FlockMember) * FlockParametersTHR.FleeScaleAquarium;
+						FleeVec = SteeringAquarium(FlockMemberID) * FlockParametersTHR.FleeScaleAquarium;
 						if (FleeVec != FVector::ZeroVector)
 						{
 							bIsAvoidance = true;
@@ -253,144 +521,378 @@ uint32 FlockThread::Run()
 				// Flee = running away from max height!
 				if (FlockParametersTHR.bUseMaxHeight)
 				{
-					if (FlockMemberLocation.Z >= FlockParametersTHR.MaxHeight)
+					if (FlockMemberLocation.Z >= WorldSnapshotTHR.MaxHeight)
 					{
 						// Flee = running away from Aquarium wall!
-						FleeVec = SteeringMaxHeight(FlockMember) * FlockParametersTHR.FleeScaleAquarium;
+						FleeVec = SteeringMaxHeight(FlockMemberID) * FlockParametersTHR.FleeScaleAquarium;
 						if (FleeVec != FVector::ZeroVector)
 						{
 							bIsAvoidance = true;
 						}
 					}
 				}
-				// Follow to leader.
-				NewVelocity += FleeVec;
-				if (FleeVec.SizeSquared() <= 0.1f)
-				{
-					NewVelocity += FollowVec;
-					NewVelocity += CohesionVec;
-					NewVelocity += AlignmentVec;
-					NewVelocity += SeparationVec;
-				}
-				// Truncate the new force calculated in newVelocity so we don't go crazy
-				NewVelocity = NewVelocity.GetClampedToSize(0.0f, FlockParametersTHR.FlockMaxSteeringForce);
+			}
+			if (bIsAvoidance)
+			{
+				++Scratch.NumAvoidanceTriggers;
+			}
 
-				FVector TargetVelocity = FlockMember.Velocity + NewVelocity;
+			// Follow to leader.
+			NewVelocity += FleeVec;
+			if (FleeVec.SizeSquared() <= 0.1f)
+			{
+				NewVelocity += FollowVec;
+				NewVelocity += CohesionVec;
+				NewVelocity += AlignmentVec;
+				NewVelocity += SeparationVec;
+			}
+			// Truncate the new force calculated in newVelocity so we don't go crazy
+			NewVelocity = NewVelocity.GetClampedToSize(0.0f, FlockParametersTHR.FlockMaxSteeringForce);
 
-				float FlockRotRate(FlockParametersTHR.FlockMateRotationRate);
-				if (bIsAvoidance)
-				{
-					FlockRotRate = FlockParametersTHR.EscapeMateRotationRate;
-				}
-				// Rotate the flock member towards the Velocity direction vector
-				// get the rotation value for our desired target Velocity (i.e. if we were in that direction)
-				// Interpolate our current rotation towards the desired Velocity vector based on rotation speed * time
-				FRotator Rot = FRotationMatrix::MakeFromX((FlockMemberLocation + TargetVelocity) - FlockMemberLocation).Rotator();
-				FRotator Final = FMath::RInterpTo(FlockMember.Transform.Rotator(), Rot, ThreadDeltaTime, FlockRotRate);
+			FVector TargetVelocity = StepMembers->GetVelocity(FlockMemberID) + NewVelocity;
 
-				FlockMember.Transform.SetRotation(Final.Quaternion());
+			float FlockRotRate(FlockParametersTHR.FlockMateRotationRate);
+			if (bIsAvoidance)
+			{
+				FlockRotRate = FlockParametersTHR.EscapeMateRotationRate;
+			}
+			// Rotate the flock member towards the Velocity direction vector
+			// Heading without roll for our desired target Velocity, then nlerp our current rotation towards it based on rotation speed * time
+			Orientation = StepMembers->Orientations[FlockMemberID];
+			float const TargetSpeed = TargetVelocity.Size();
+			if (TargetSpeed > KINDA_SMALL_NUMBER)
+			{
+				FQuat const TargetOrientation = FRotationMatrix::MakeFromX(TargetVelocity / TargetSpeed).ToQuat();
+				float const RotationAlpha = FlockRotRate > 0.f ? FMath::Clamp(MemberDeltaTime * FlockRotRate, 0.f, 1.f) : 1.f;
+				Orientation = FQuat::FastLerp(Orientation, TargetOrientation, RotationAlpha).GetNormalized();
+			}
 
-				FVector Forward = FlockMember.Transform.GetUnitAxis(EAxis::X);
-				Forward.Normalize();
-				FlockMember.Velocity = Forward * TargetVelocity.Size();
+			// Unit length, orientation is normalized.
+			FVector const Forward = Orientation.GetAxisX();
+			Velocity = Forward * TargetSpeed;
 
-				// Clamp our new Velocity to be within min->max speeds
-				if (FlockMember.Velocity.Size() > FlockParametersTHR.FlockMaxSpeed)
-				{
-					FlockMember.Velocity = FlockMember.Velocity.GetSafeNormal() * FMath::RandRange(FlockParametersTHR.FlockMaxSpeed - FlockParametersTHR.FlockOffsetSpeed,
-					                                                                                 FlockParametersTHR.FlockMaxSpeed + FlockParametersTHR.FlockOffsetSpeed);
-				}
-				// If need escape from danger actor.
-				if (bIsAvoidance)
-				{
-					FlockMember.Velocity = FlockMember.Velocity * FlockParametersTHR.EscapeMaxSpeedMultiply;
-				}
-				FVector SetSpeed = FlockMemberLocation + FlockMember.Velocity;
+			// Clamp our new Velocity to be within min->max speeds
+			if (TargetSpeed > FlockParametersTHR.FlockMaxSpeed)
+			{
+				Velocity = Forward * Random.FRandRange(FlockParametersTHR.FlockMaxSpeed - FlockParametersTHR.FlockOffsetSpeed,
+				                                       FlockParametersTHR.FlockMaxSpeed + FlockParametersTHR.FlockOffsetSpeed);
+			}
+			// If need escape from danger actor.
+			if (bIsAvoidance)
+			{
+				Velocity = Velocity * FlockParametersTHR.EscapeMaxSpeedMultiply;
+			}
+			FVector SetSpeed = FlockMemberLocation + Velocity;
 
-				FlockMember.Transform.SetLocation(FMath::VInterpTo(FlockMemberLocation, SetSpeed, ThreadDeltaTime, FlockParametersTHR.MoveSpeedInterpInThread));
+			NewLocation = FMath::VInterpTo(FlockMemberLocation, SetSpeed, StepDeltaTime, FlockParametersTHR.MoveSpeedInterpInThread);
+		}
 
-				// Save all parameters.
-				FlockThreadMembersArr[FlockMemberID] = FlockMember;
-			}
+		// Save all parameters.
+		OutMembers.Positions[FlockMemberID] = FVector4(NewLocation, StepMembers->Positions[FlockMemberID].W);
+		OutMembers.Velocities[FlockMemberID] = FVector4(Velocity, 0.f);
+		OutMembers.Orientations[FlockMemberID] = Orientation;
+		OutMembers.WanderTargets[FlockMemberID] = WanderTarget;
+		OutMembers.Flags[FlockMemberID] = StepMembers->Flags[FlockMemberID];
+		OutMembers.InstanceIndices[FlockMemberID] = StepMembers->InstanceIndices[FlockMemberID];
+		OutMembers.RandomSeeds[FlockMemberID] = Random.GetCurrentSeed();
+
+		// State before the last substep, for render interpolation.
+		if (bLastSubstep)
+		{
+			NextStepResult->PreviousPositions[FlockMemberID] = StepMembers->Positions[FlockMemberID];
+			NextStepResult->PreviousOrientations[FlockMemberID] = StepMembers->Orientations[FlockMemberID];
+		}
+	}
+}
 
-			ThreadDeltaTime = FTimespan(FPlatformTime::Cycles64() - TimePlatform).GetTotalSeconds();
+FlockLOD::Type FlockSimulation::GetMemberLOD(const FVector& Location) const
+{
+	// Without player views (e.g. dedicated server without players) all members are near.
+	if (!FlockParametersTHR.bUseSimulationLOD || WorldSnapshotTHR.ViewLocations.Num() == 0) return FlockLOD::Near;
 
-			if (FlockParametersTHR.ExperimentalOptimization)
-			{
-				ThreadDeltaTime += ThreadSleepTime;
-			}
+	float MinDistanceSquared = MAX_flt;
+	for (FVector const& ViewLocation : WorldSnapshotTHR.ViewLocations)
+	{
+		MinDistanceSquared = FMath::Min(MinDistanceSquared, FVector::DistSquared(Location, ViewLocation));
+	}
 
-			//Critical section:
-			Mutex.Lock();
-			//We are locking our FCriticalSection so no other thread will access it
-			//And thus it is a thread-safe access now
+	if (MinDistanceSquared < FMath::Square(FlockParametersTHR.LODMidDistance)) return FlockLOD::Near;
+	if (MinDistanceSquared < FMath::Square(FlockParametersTHR.LODFarDistance)) return FlockLOD::Mid;
+	return FlockLOD::Far;
+}
 
-			FlockThreadMembersArr = FlockMembersArr;
+int32 FlockSimulation::GetLODStepInterval(FlockLOD::Type LOD) const
+{
+	switch (LOD)
+	{
+	case FlockLOD::Mid:
+		return FMath::Max(1, FlockParametersTHR.LODMidStepInterval);
+	case FlockLOD::Far:
+		return FMath::Max(1, FlockParametersTHR.LODFarStepInterval);
+	default:
+		return 1;
+	}
+}
 
-			//Unlock FCriticalSection so other threads may use it.
-			Mutex.Unlock();
+const FlockStepResult& FlockSimulation::GetFlockMembersData()
+{
+	SCOPE_CYCLE_COUNTER(STAT_FlockGetMembersData);
+	StepBuffers.Consume();
 
-			//Pause Condition - if we RandomVectors contains more vectors than Amount we shall pause the thread to release system resources.
-			Pause = true;
+	return StepBuffers.GetReadBuffer();
+}
 
-			if (FlockParametersTHR.ExperimentalOptimization)
-			{
-				//A little sleep between the chunks (So CPU will rest a bit -- (may be omitted))
-				FPlatformProcess::Sleep(ThreadSleepTime);
-			}
-		}
+void FlockSimulation::InitFlockParameters(const FlockMemberStore& SetFlockMembers, int32 NumGroups, FlockMemberParameters NewParameters)
+{
+	FlockParametersTHR = NewParameters;
+
+	switch (FlockParametersTHR.ThreadPriority)
+	{
+	case EPriority::Highest:
+	case EPriority::TimeCritical:
+		StepTaskThread = ENamedThreads::AnyHiPriThreadHiPriTask;
+		StepParallelForFlags = EParallelForFlags::Unbalanced;
+		break;
+	case EPriority::BelowNormal:
+	case EPriority::SlightlyBelowNormal:
+		StepTaskThread = ENamedThreads::AnyBackgroundHiPriTask;
+		StepParallelForFlags = EParallelForFlags::Unbalanced | EParallelForFlags::BackgroundPriority;
+		break;
+	case EPriority::Lowest:
+		StepTaskThread = ENamedThreads::AnyBackgroundThreadNormalTask;
+		StepParallelForFlags = EParallelForFlags::Unbalanced | EParallelForFlags::BackgroundPriority;
+		break;
+
+	default:
+		StepTaskThread = ENamedThreads::AnyHiPriThreadNormalTask;
+		StepParallelForFlags = EParallelForFlags::Unbalanced;
+		break;
 	}
-	return 0;
+
+	FlockStepResult InitialResult;
+	InitialResult.Members = SetFlockMembers;
+	InitFlockLeaders(InitialResult.Members, NumGroups);
+	InitialResult.PreviousPositions = InitialResult.Members.Positions;
+	InitialResult.PreviousOrientations = InitialResult.Members.Orientations;
+
+	StepBuffers.Reset(InitialResult);
+
+	// Reserve step memory up front, so steady state steps do not allocate.
+	SubstepMembers.Reserve(SetFlockMembers.Num());
+	ChunkScratches.SetNum(FMath::DivideAndRoundUp(SetFlockMembers.Num(), FMath::Max(1, CVarFlockStepChunkSize.GetValueOnGameThread())));
 }
 
-void FlockThread::Stop()
+void FlockSimulation::InitFlockLeaders(FlockMemberStore& Members, int32 NumGroups)
 {
-	Kill = true; //Thread kill condition "while (!Kill){...}"
-	Pause = false;
+	int32 const NumMembers = Members.Num();
+	MemberLeaderGroups.SetNumUninitialized(NumMembers);
+	GroupLeaders.Reset();
+	if (NumMembers == 0) return;
+
+	// More groups than members makes one group.
+	bool const bOneGroup = NumGroups > NumMembers;
+	NumGroups = bOneGroup ? 1 : FMath::Max(1, NumGroups);
+
+	// With one group or one leader, follow actor replaces all leaders and one leader keeps only the first one.
+	bool const bResetLeaders = bOneGroup || FlockParametersTHR.bUseOneLeader;
+	bLeaderFlags = !(bResetLeaders && FlockParametersTHR.FollowActor);
+
+	// Leader of the first group is leader for all when use one leader.
+	GroupLeaders.Init(INDEX_NONE, FlockParametersTHR.bUseOneLeader ? 1 : NumGroups);
+
+	int32 const GroupSize = NumMembers / NumGroups;
 
-	if (Semaphore)
+	for (int32 GroupID = 0; GroupID < NumGroups; ++GroupID)
+	{
+		int32 const GroupStart = GroupID * GroupSize;
+		// Adding the remainder of the division to the last group.
+		int32 const GroupEnd = GroupID == NumGroups - 1 ? NumMembers : GroupStart + GroupSize;
+
+		for (int32 FlockMemberID = GroupStart; FlockMemberID < GroupEnd; ++FlockMemberID)
+		{
+			MemberLeaderGroups[FlockMemberID] = FlockParametersTHR.bUseOneLeader ? 0 : GroupID;
+			Members.SetFlag(FlockMemberID, FlockMemberFlags::Leader, false);
+		}
+	}
+
+	// First active member of a group leads it.
+	for (int32 FlockMemberID = 0; FlockMemberID < NumMembers; ++FlockMemberID)
+	{
+		if (Members.HasFlag(FlockMemberID, FlockMemberFlags::Active) && GroupLeaders[MemberLeaderGroups[FlockMemberID]] == INDEX_NONE)
+		{
+			SetGroupLeader(Members, MemberLeaderGroups[FlockMemberID], FlockMemberID);
+		}
+	}
+}
+
+void FlockSimulation::SetGroupLeader(FlockMemberStore& Members, int32 LeaderGroup, int32 FlockMemberID)
+{
+	GroupLeaders[LeaderGroup] = FlockMemberID;
+	if (FlockMemberID != INDEX_NONE && bLeaderFlags)
 	{
-		//We shall signal "Trigger" the FEvent (in case the Thread is sleeping it shall wake up!!)
-		Semaphore->Trigger();
+		Members.SetFlag(FlockMemberID, FlockMemberFlags::Leader, true);
 	}
 }
 
-bool FlockThread::IsThreadPaused() const
+void FlockSimulation::SetMemberCommands(const TArray<FlockMemberCommand>& Commands)
 {
-	return (bool)Pause;
+	MemberCommandsTHR.Reset();
+	MemberCommandsTHR.Append(Commands);
 }
 
-TArray<FlockMemberData> FlockThread::GetFlockMembersData()
+void FlockSimulation::ApplyMemberCommands()
 {
-	Mutex.Lock();
+	FlockMemberStore& Members = NextStepResult->Members;
 
-	TArray<FlockMemberData> actualArray_ = FlockThreadMembersArr;
+	for (FlockMemberCommand const& Command : MemberCommandsTHR)
+	{
+		int32 const Slot = Command.Slot;
+		if (!Members.Flags.IsValidIndex(Slot)) continue;
 
-	this->ContinueThread();
+		int32 const LeaderGroup = MemberLeaderGroups[Slot];
 
-	Mutex.Unlock();
+		switch (Command.Type)
+		{
+		case FlockMemberCommandType::Spawn:
+		{
+			float const Scale = Command.Transform.GetScale3D().X;
+			Members.Positions[Slot] = FVector4(Command.Transform.GetLocation(), Scale);
+			Members.Velocities[Slot] = FVector4(0.f, 0.f, 0.f, 0.f);
+			Members.Orientations[Slot] = Command.Transform.GetRotation();
+			// Elapsed time at update rate, so a new leader picks its wander location in the first step.
+			Members.WanderTargets[Slot] = FVector4(0.f, 0.f, 0.f, FlockParametersTHR.FlockWanderUpdateRate);
+			Members.Flags[Slot] = FlockMemberFlags::Active;
+			Members.RandomSeeds[Slot] = Command.RandomSeed;
+
+			// Nothing to interpolate from.
+			NextStepResult->PreviousPositions[Slot] = Members.Positions[Slot];
+			NextStepResult->PreviousOrientations[Slot] = Members.Orientations[Slot];
+
+			if (GroupLeaders[LeaderGroup] == INDEX_NONE)
+			{
+				SetGroupLeader(Members, LeaderGroup, Slot);
+			}
+			break;
+		}
+		case FlockMemberCommandType::Remove:
+		{
+			Members.Flags[Slot] = FlockMemberFlags::None;
 
-	return actualArray_;
+			// Removed leader, the next active member of its group takes over.
+			if (GroupLeaders[LeaderGroup] == Slot)
+			{
+				int32 NewLeader = INDEX_NONE;
+				for (int32 FlockMemberID = 0; FlockMemberID < Members.Num(); ++FlockMemberID)
+				{
+					if (MemberLeaderGroups[FlockMemberID] == LeaderGroup && Members.HasFlag(FlockMemberID, FlockMemberFlags::Active))
+					{
+						NewLeader = FlockMemberID;
+						break;
+					}
+				}
+				SetGroupLeader(Members, LeaderGroup, NewLeader);
+			}
+			break;
+		}
+		case FlockMemberCommandType::Correct:
+			// Scale, orientation and random stream are not corrected.
+			if (Members.HasFlag(Slot, FlockMemberFlags::Active))
+			{
+				// Server state is some substeps old, move it along its velocity to this substep. At most a second, in case of a bad offset.
+				float const ExtrapolationTime = FMath::Clamp(float(int32(SubstepCounter) - Command.StepNumber) * StepDeltaTime, -1.f, 1.f);
+				Members.Positions[Slot] = FVector4(Command.Location + Command.Velocity * ExtrapolationTime, Members.Positions[Slot].W);
+				Members.Velocities[Slot] = FVector4(Command.Velocity, 0.f);
+			}
+			break;
+		case FlockMemberCommandType::Wander:
+			Members.WanderTargets[Slot] = FVector4(Command.Location, Members.WanderTargets[Slot].W);
+			break;
+		}
+	}
+
+	MemberCommandsTHR.Reset();
 }
 
-void FlockThread::InitFlockParameters(TArray<FlockMemberData> SetFlockMembersArr, FlockMemberParameters NewParameters, UBoxComponent* SetBoxComponent)
+void FlockSimulation::SetWorldSnapshot(const FlockWorldSnapshot& Snapshot)
 {
-	FlockParametersTHR = NewParameters;
-	BoxComponentRef = SetBoxComponent;
-	FlockThreadMembersArr = SetFlockMembersArr;
+	// Reset and Append keep memory, assignment would reallocate when size changes.
+	WorldSnapshotTHR.DangerLocations.Reset();
+	WorldSnapshotTHR.DangerLocations.Append(Snapshot.DangerLocations);
+	WorldSnapshotTHR.DangerActors.Reset();
+	WorldSnapshotTHR.DangerActors.Append(Snapshot.DangerActors);
+	WorldSnapshotTHR.FollowLocation = Snapshot.FollowLocation;
+	WorldSnapshotTHR.bHasFollowActor = Snapshot.bHasFollowActor;
+	WorldSnapshotTHR.AquariumCenter = Snapshot.AquariumCenter;
+	WorldSnapshotTHR.AquariumExtent = Snapshot.AquariumExtent;
+	WorldSnapshotTHR.MaxHeight = Snapshot.MaxHeight;
+	WorldSnapshotTHR.ViewLocations.Reset();
+	WorldSnapshotTHR.ViewLocations.Append(Snapshot.ViewLocations);
+}
+
+SIZE_T FlockSimulation::GetAllocatedSize() const
+{
+	SIZE_T Size = SubstepMembers.GetAllocatedSize() + Grid.GetAllocatedSize() + ChunkScratches.GetAllocatedSize()
+		+ MemberLeaderGroups.GetAllocatedSize() + GroupLeaders.GetAllocatedSize() + MemberCommandsTHR.GetAllocatedSize();
+	for (int32 BufferIndex = 0; BufferIndex < 3; ++BufferIndex)
+	{
+		FlockStepResult const& Result = StepBuffers.GetBuffer(BufferIndex);
+		Size += Result.Members.GetAllocatedSize() + Result.AttackedActors.GetAllocatedSize()
+			+ Result.PreviousPositions.GetAllocatedSize() + Result.PreviousOrientations.GetAllocatedSize();
+	}
+	for (FlockChunkScratch const& Scratch : ChunkScratches)
+	{
+		Size += Scratch.Mates.GetAllocatedSize() + Scratch.AttackedActors.GetAllocatedSize();
+	}
+	return Size;
+}
 
-	FlockThreadMembersArr[0].bIsFlockLeader = true;
+void FlockSimulation::SetAvoidanceField(TSharedPtr<const FlockDistanceField, ESPMode::ThreadSafe> NewAvoidanceField)
+{
+	AvoidanceFieldTHR = NewAvoidanceField;
 }
 
-void FlockThread::SetOverlappingComponents(TArray<UPrimitiveComponent*> OverlappingComponentsArr, TArray<AActor*> DangerActors)
+void FlockSimulation::SetRecorder(TSharedPtr<FlockReplayRecorder, ESPMode::ThreadSafe> NewRecorder)
 {
-	AllOverlappingComponentsArrTHR = OverlappingComponentsArr;
-	DangerActorsTHR = DangerActors;
+	RecorderTHR = NewRecorder;
 }
 
-void FlockThread::SetAvoidanceActor(TArray<AActor*> AvoidanceActorRootArr)
+void FlockSimulation::SetSharedIndex(const FlockSharedIndex* NewSharedIndex, const TArray<FName>& FlockTypes, int32 OwnFlockIndex)
 {
-	AvoidanceActorRootArrTHR = AvoidanceActorRootArr;
+	SharedIndexTHR = nullptr;
+	InteractionFlocks.Reset();
+	InteractionFlockRules.Reset();
+	if (!NewSharedIndex) return;
+
+	// Rules are matched once per step, not per member. Own flock is never queried.
+	for (int32 FlockIndex = 0; FlockIndex < FlockTypes.Num(); ++FlockIndex)
+	{
+		if (FlockIndex == OwnFlockIndex) continue;
+
+		for (int32 RuleIndex = 0; RuleIndex < FlockParametersTHR.InteractionRules.Num(); ++RuleIndex)
+		{
+			if (FlockParametersTHR.InteractionRules[RuleIndex].OtherFlockType == FlockTypes[FlockIndex])
+			{
+				InteractionFlocks.Add(FlockIndex);
+				InteractionFlockRules.Add(RuleIndex);
+				break;
+			}
+		}
+	}
+
+	if (InteractionFlocks.Num() > 0)
+	{
+		SharedIndexTHR = NewSharedIndex;
+	}
+}
+
+float FlockSimulation::GetInteractionRadius() const
+{
+	float InteractionRadius = 0.f;
+	for (FlockInteractionRule const& Rule : FlockParametersTHR.InteractionRules)
+	{
+		InteractionRadius = FMath::Max(InteractionRadius, Rule.Radius);
+	}
+	return InteractionRadius;
 }
 
 void AFlockSystemActor::BeginPlay()
@@ -401,167 +903,616 @@ void AFlockSystemActor::BeginPlay()
 
 	StaticMeshInstanceComponent->SetStaticMesh(StaticMesh);
 
+	// Before instances are added, so every instance gets its custom data.
+	StaticMeshInstanceComponent->SetNumCustomDataFloats(NumCustomDataFloats);
+
+	// Client flock is spawned from server seed.
+	if (IsReplicatedClient() && ReplicatedSeed == 0) return;
+
+	SpawnFlock();
+}
+
+void AFlockSystemActor::SpawnFlock()
+{
+	// Replicated flock steps the same on server and clients.
+	if (bReplicateFlock)
+	{
+		FlockParameters.bDeterministic = true;
+	}
+
+	// Deterministic simulation depends only on seed and fixed step, not on frame time or views.
+	if (FlockParameters.bDeterministic)
+	{
+		FlockParameters.bUseFixedTimeStep = true;
+		FlockParameters.bUseSimulationLOD = false;
+	}
+	bool const bFixedSeed = FlockParameters.RandomSeed != 0 || (FlockParameters.bDeterministic && !bReplicateFlock);
+	SimulationSeed = bFixedSeed ? FlockParameters.RandomSeed : FMath::Max(1, FMath::Rand());
+	if (IsReplicatedClient())
+	{
+		SimulationSeed = ReplicatedSeed;
+	}
+	else if (bReplicateFlock)
+	{
+		ReplicatedSeed = SimulationSeed != 0 ? SimulationSeed : 1;
+		SimulationSeed = ReplicatedSeed;
+		GetWorldTimerManager().SetTimer(NetUpdate_Timer, this, &AFlockSystemActor::UpdateFlockReplication, NetUpdateInterval, true);
+	}
+	SpawnRandom.Initialize(SimulationSeed);
+
 	FVector const StartLoc(GetActorLocation());
 
-	for (int i = 0; i < FlockMateInstances; ++i)
+	// Settled flock from snapshot, random spawn only adds missing slots.
+	int32 const NumLoaded = !WarmStartSnapshot.IsEmpty() && LoadWarmStartSnapshot() ? NumFlock : 0;
+
+	for (int i = NumLoaded; i < FlockMateInstances; ++i)
 	{
-		FVector const Direction(FMath::VRand());
-		FRotator const Rotation(UKismetMathLibrary::RandomRotator());
-		float const Distance(FMath::RandRange(0.01f, SphereComponent->GetScaledSphereRadius()));
+		FVector const Direction(SpawnRandom.VRand());
+		FRotator const Rotation(SpawnRandom.FRand() * 360.f, SpawnRandom.FRand() * 360.f, 0.f);
+		float const Distance(SpawnRandom.FRandRange(0.01f, SphereComponent->GetScaledSphereRadius()));
 		FVector const NewLoc(StartLoc + Direction * Distance);
-		float const RandScale(FMath::RandRange(MinMeshScale, MaxMeshScale));
+		float const RandScale(SpawnRandom.FRandRange(MinMeshScale, MaxMeshScale));
 
 		AddFlockMemberWorldSpace(FTransform(Rotation, NewLoc, FVector(RandScale, RandScale, RandScale)));
 	}
 
+	// Free slots for SpawnMembers. Hidden instances at actor location.
+	for (int32 Slot = FMath::Max(FlockMateInstances, NumLoaded); Slot < MaxFlockMembers; ++Slot)
+	{
+		AddFlockMemberWorldSpace(FTransform(FQuat::Identity, StartLoc, FVector::ZeroVector), false);
+	}
+	PendingMemberCommands.Reserve(MaxFlockMembers);
+
 	if (FlockParameters.bAutoAddComponentsInArray || FlockParameters.bReactOnPawn)
 	{
 		GetWorldTimerManager().SetTimer(AddAvoidanceActor_Timer, this, &AFlockSystemActor::AddAvoidanceComponentsTimer, 1.f, true, 0.5f);
 	}
 
-	DivideFlockArrayForThreads();
+	GenerateFlockSimulation();
 
-	for (int i = 0; i < FlockActorPoolThreadArr.Num(); i++)
+	UFlockSubsystem* FlockSubsystem = bSimulateInWorldSubsystem ? GetWorld()->GetSubsystem<UFlockSubsystem>() : nullptr;
+	if (FlockSubsystem)
 	{
-		FlockActorPoolThreadArr[i] = nullptr;
+		FlockSubsystem->RegisterFlock(this);
+		bRegisteredInSubsystem = true;
 	}
-
-	GenerateFlockThread();
 }
 
 void AFlockSystemActor::EndPlay(const EEndPlayReason::Type EndPlayReason)
 {
-	for (int i = 0; i < FlockActorPoolThreadArr.Num(); i++)
+	if (bRegisteredInSubsystem)
 	{
-		if (FlockActorPoolThreadArr[i])
+		UFlockSubsystem* FlockSubsystem = GetWorld()->GetSubsystem<UFlockSubsystem>();
+		if (FlockSubsystem)
 		{
-			FlockActorPoolThreadArr[i]->EnsureCompletion();
-			delete FlockActorPoolThreadArr[i];
-			FlockActorPoolThreadArr[i] = nullptr;
+			FlockSubsystem->UnregisterFlock(this);
 		}
+		bRegisteredInSubsystem = false;
+	}
+
+	FinishAvoidanceBake(true);
+	if (Simulation)
+	{
+		Simulation->EnsureCompletion();
+		delete Simulation;
+		Simulation = nullptr;
 	}
-	FlockActorPoolThreadArr.Empty();
 
 	Super::EndPlay(EndPlayReason);
 }
 
 void AFlockSystemActor::BeginDestroy()
 {
-	for (int i = 0; i < FlockActorPoolThreadArr.Num(); i++)
+	FinishAvoidanceBake(true);
+	if (Simulation)
 	{
-		if (FlockActorPoolThreadArr[i])
-		{
-			FlockActorPoolThreadArr[i]->EnsureCompletion();
-			delete FlockActorPoolThreadArr[i];
-			FlockActorPoolThreadArr[i] = nullptr;
-		}
+		Simulation->EnsureCompletion();
+		delete Simulation;
+		Simulation = nullptr;
 	}
-	FlockActorPoolThreadArr.Empty();
 
 	Super::BeginDestroy();
 }
 
 void AFlockSystemActor::Tick(float DeltaTime)
 {
+	SCOPE_CYCLE_COUNTER(STAT_FlockTick);
+	TRACE_CPUPROFILER_EVENT_SCOPE(AFlockSystemActor::Tick);
+
 	Super::Tick(DeltaTime);
-	if (!StaticMeshInstanceComponent) return;
+	if (!StaticMeshInstanceComponent || !Simulation) return;
+
+	// Spawns and removes of the last frame to clients.
+	if (OutgoingNetCommands.Num() > 0)
+	{
+		MulticastMemberCommands(OutgoingNetCommands);
+		INC_DWORD_STAT_BY(STAT_FlockNetPayloadBytes, OutgoingNetCommands.Num() * (sizeof(int32) * 2 + sizeof(FVector) + sizeof(FQuat) + sizeof(float) + 1));
+		OutgoingNetCommands.Reset();
+	}
+
+	// Latest finished step or replayed frame. Valid until the next GetFlockMembersData().
+	FlockStepResult const& StepResult = ReplayPlayer.IsValid() ? AdvanceReplay(DeltaTime) : Simulation->GetFlockMembersData();
+
+	// Next step runs on worker threads while this frame moves instances. Replay runs no steering.
+	if (!ReplayPlayer.IsValid())
+	{
+		PendingStepTime += DeltaTime;
+		if (!Simulation->IsStepRunning())
+		{
+			FinishAvoidanceBake(false);
+			if (bAvoidanceDirty)
+			{
+				Simulation->SetAvoidanceField(AvoidanceField);
+				bAvoidanceDirty = false;
+			}
+
+			{
+				SCOPE_CYCLE_COUNTER(STAT_FlockSnapshotCopy);
+				UpdateWorldSnapshot();
+				Simulation->SetWorldSnapshot(WorldSnapshot);
+				Simulation->SetMemberCommands(PendingMemberCommands);
+				PendingMemberCommands.Reset();
+			}
+
+			if (FlockParameters.bUseFixedTimeStep)
+			{
+				// Whole fixed steps of accumulated game time.
+				float const FixedDeltaTime = 1.f / FMath::Max(1.f, FlockParameters.FixedStepRate);
+				int32 const NumSubsteps = FMath::Min(FMath::FloorToInt(PendingStepTime / FixedDeltaTime), FMath::Max(1, FlockParameters.MaxSubsteps));
+
+				if (NumSubsteps > 0)
+				{
+					StartSimulationStep(FixedDeltaTime, NumSubsteps);
+					PendingStepTime -= NumSubsteps * FixedDeltaTime;
+				}
+
+				// Drop time above max substeps, so slow frames do not pile up.
+				PendingStepTime = FMath::Min(PendingStepTime, FixedDeltaTime);
+			}
+			else
+			{
+				StartSimulationStep(PendingStepTime, 1);
+				PendingStepTime = 0.f;
+			}
+		}
+	}
+
+	FlockMemberStore const& StepMembers = StepResult.Members;
+	LastStepTime = StepResult.StepTime;
+
+	INC_DWORD_STAT_BY(STAT_FlockMembersLODNear, StepResult.NumMembersInLOD[FlockLOD::Near]);
+	INC_DWORD_STAT_BY(STAT_FlockMembersLODMid, StepResult.NumMembersInLOD[FlockLOD::Mid]);
+	INC_DWORD_STAT_BY(STAT_FlockMembersLODFar, StepResult.NumMembersInLOD[FlockLOD::Far]);
+	INC_DWORD_STAT_BY(STAT_FlockMembers, NumActiveMembers);
+	INC_DWORD_STAT_BY(STAT_FlockNeighborsVisited, StepResult.NumNeighborsVisited);
+	INC_DWORD_STAT_BY(STAT_FlockAvoidanceTriggers, StepResult.NumAvoidanceTriggers);
+	INC_FLOAT_STAT_BY(STAT_FlockNeighborQueryTime, StepResult.BehaviorTimes[FlockBehavior::NeighborQuery]);
+	INC_FLOAT_STAT_BY(STAT_FlockSteeringAccumulateTime, StepResult.BehaviorTimes[FlockBehavior::SteeringAccumulate]);
+	INC_FLOAT_STAT_BY(STAT_FlockFleeTime, StepResult.BehaviorTimes[FlockBehavior::Flee]);
+	INC_FLOAT_STAT_BY(STAT_FlockAvoidanceTime, StepResult.BehaviorTimes[FlockBehavior::Avoidance]);
+	INC_FLOAT_STAT_BY(STAT_FlockAquariumTime, StepResult.BehaviorTimes[FlockBehavior::Aquarium]);
+	INC_FLOAT_STAT_BY(STAT_FlockInteractionTime, StepResult.BehaviorTimes[FlockBehavior::Interaction]);
+
+	// Part of fixed step passed after the latest state.
+	float const InterpStepTime = ReplayPlayer.IsValid() ? ReplayPlayer->GetNextFrameDeltaTime() : 1.f / FMath::Max(1.f, FlockParameters.FixedStepRate);
+	float const InterpAlpha = FMath::Clamp(PendingStepTime / InterpStepTime, 0.f, 1.f);
+
+	// Instances are updated in component space, like UpdateInstanceTransform does for world space transforms.
+	FTransform const ComponentTransform = StaticMeshInstanceComponent->GetComponentTransform();
+	int32 const NumInstances = FMath::Min3(StaticMeshInstanceComponent->GetInstanceCount(), InstanceTransforms.Num(), FMath::Min3(InstanceStates.Num(), InstanceDirty.Num(), ActiveSlots.Num()));
+
+	// Without local player views or extra views nothing is culled.
+	UpdateViewFrustums();
+	bool const bCullInstances = bUseViewCulling && (NumViewFrustums > 0 || ExtraViewFrustums.Num() > 0);
+	// Bound of unscaled mesh, scaled by member scale.
+	float const MeshRadius = StaticMesh ? StaticMesh->GetBounds().SphereRadius : 0.f;
+	FThreadSafeBool bAnyInstanceDirty = false;
+
+	// Workers fill animation data of changed instances, it goes into the component with their transforms.
+	int32 const NumDataFloats = FMath::Min(StaticMeshInstanceComponent->NumCustomDataFloats, MaxAnimationDataFloats);
+	float* CustomData = nullptr;
+	if (NumDataFloats > 0)
+	{
+		InstanceAnimationData.SetNumUninitialized(NumInstances * MaxAnimationDataFloats, false);
+		CustomData = InstanceAnimationData.GetData();
+	}
+	float const InvMaxSpeed = 1.f / FMath::Max(FlockParameters.FlockMaxSpeed, KINDA_SMALL_NUMBER);
+
+	// Move flock members. Every member writes only its own instance, so members are independent.
+	TickParallelFor.Run(StepMembers.Num(), TickChunkSize, [this, &StepResult, &StepMembers, &ComponentTransform, NumInstances, InterpAlpha, DeltaTime, bCullInstances, MeshRadius, &bAnyInstanceDirty,
+		        CustomData, NumDataFloats, InvMaxSpeed](int32 FlockMemberID)
+	{
+		int32 const InstanceIndex = StepMembers.InstanceIndices[FlockMemberID];
+		if (InstanceIndex >= NumInstances || InstanceIndex >= RenderedLocations.Num()) return; // don't do anything if we haven't got an instance in range...
+
+		// Free slot, or spawned on game thread but not simulated yet. Instance is hidden with zero scale.
+		if ((!ActiveSlots[InstanceIndex] && !ReplayPlayer.IsValid()) || !StepMembers.HasFlag(FlockMemberID, FlockMemberFlags::Active))
+		{
+			// Shown last frame, in view or culled, upload is needed to hide it.
+			if (InstanceStates[InstanceIndex] != FlockInstanceState::Hidden)
+			{
+				InstanceStates[InstanceIndex] = FlockInstanceState::Hidden;
+				InstanceTransforms[InstanceIndex] = FTransform(FQuat::Identity, FVector::ZeroVector, FVector::ZeroVector);
+				InstanceDirty[InstanceIndex] = true;
+				if (!bAnyInstanceDirty)
+				{
+					bAnyInstanceDirty = true;
+				}
+			}
+			return;
+		}
 
-	TArray<FlockMemberData> FlockMembersDataArr;
+		if (bCullInstances)
+		{
+			// Outside of all views, skip interpolation and keep the last instance transform. Simulation still steps it.
+			// Hidden instance stays hidden until it enters a view.
+			float const BoundRadius = MeshRadius * StepMembers.Positions[FlockMemberID].W + ViewCullingPadding;
+			if (!IsInAnyViewFrustum(StepMembers.GetLocation(FlockMemberID), BoundRadius))
+			{
+				if (InstanceStates[InstanceIndex] == FlockInstanceState::Visible)
+				{
+					InstanceStates[InstanceIndex] = FlockInstanceState::Culled;
+				}
+				return;
+			}
+		}
+
+		// Back in view, interpolation starts from the current location instead of the stale one.
+		if (InstanceStates[InstanceIndex] != FlockInstanceState::Visible)
+		{
+			RenderedLocations[InstanceIndex] = StepMembers.GetLocation(FlockMemberID);
+			InstanceStates[InstanceIndex] = FlockInstanceState::Visible;
+		}
+
+		InstanceDirty[InstanceIndex] = true;
+		if (!bAnyInstanceDirty)
+		{
+			bAnyInstanceDirty = true;
+		}
+
+		FTransform InterpFlockTransform(StepMembers.GetTransform(FlockMemberID));
+
+		if (FlockParameters.bUseFixedTimeStep)
+		{
+			// Interpolate between the last two fixed steps.
+			FVector4 const& PreviousPosition = StepResult.PreviousPositions[FlockMemberID];
+			FVector const InterpVector = FMath::Lerp(FVector(PreviousPosition.X, PreviousPosition.Y, PreviousPosition.Z), StepMembers.GetLocation(FlockMemberID), InterpAlpha);
+			RenderedLocations[InstanceIndex] = InterpVector;
+
+			InterpFlockTransform.SetLocation(InterpVector);
+			InterpFlockTransform.SetRotation(FQuat::Slerp(StepResult.PreviousOrientations[FlockMemberID], StepMembers.Orientations[FlockMemberID], InterpAlpha));
+		}
+		else
+		{
+			// Interpolate Vector and Rotate
+			FVector InterpVector = FMath::VInterpConstantTo(RenderedLocations[InstanceIndex], StepMembers.GetLocation(FlockMemberID), DeltaTime, InterpMoveAnimRate);
+			RenderedLocations[InstanceIndex] = InterpVector;
+
+			InterpFlockTransform.SetLocation(InterpVector);
+		}
+
+		InstanceTransforms[InstanceIndex] = InterpFlockTransform.GetRelativeTransform(ComponentTransform);
+
+		if (CustomData && InstanceIndex < AnimationPhases.Num())
+		{
+			// Animation phase advances with speed, so slow members flap slower.
+			float const SpeedAlpha = StepMembers.GetVelocity(FlockMemberID).Size() * InvMaxSpeed;
+			AnimationPhases[InstanceIndex] = FMath::Fractional(AnimationPhases[InstanceIndex] + SpeedAlpha * AnimationPhaseRate * DeltaTime);
+
+			float* InstanceData = CustomData + InstanceIndex * MaxAnimationDataFloats;
+			InstanceData[0] = AnimationPhases[InstanceIndex];
+			if (NumDataFloats > 1)
+			{
+				InstanceData[1] = SpeedAlpha;
+			}
+		}
+	});
 
-	for (int i = 0; i < FlockActorPoolThreadArr.Num(); i++)
+	// Only instances changed this frame, in view or just hidden, and one render state update. Nothing while the whole flock is out of view.
+	if (bAnyInstanceDirty)
 	{
-		if (FlockActorPoolThreadArr[i])
+		SCOPE_CYCLE_COUNTER(STAT_FlockInstanceUpload);
+		for (int32 InstanceIndex = 0; InstanceIndex < NumInstances; ++InstanceIndex)
 		{
-			TArray<FlockMemberData> TempArr = FlockActorPoolThreadArr[i]->GetFlockMembersData();
-			for (int ID = 0; ID < TempArr.Num(); ID++)
+			if (!InstanceDirty[InstanceIndex]) continue;
+
+			StaticMeshInstanceComponent->UpdateInstanceTransform(InstanceIndex, InstanceTransforms[InstanceIndex], false, false, false);
+			// Hidden instances keep their last data.
+			if (CustomData && InstanceStates[InstanceIndex] == FlockInstanceState::Visible)
 			{
-				FlockMembersDataArr.Add(TempArr[ID]);
+				for (int32 DataIndex = 0; DataIndex < NumDataFloats; ++DataIndex)
+				{
+					StaticMeshInstanceComponent->SetCustomDataValue(InstanceIndex, DataIndex, CustomData[InstanceIndex * MaxAnimationDataFloats + DataIndex], false);
+				}
 			}
+			InstanceDirty[InstanceIndex] = false;
 		}
+		StaticMeshInstanceComponent->MarkRenderStateDirty();
 	}
-	// Move flock members. 
-	for (int32 FlockMemberID = 0; FlockMemberID < FlockMembersDataArr.Num(); ++FlockMemberID)
+
+	// Attack Pawn. Only server of replicated flock applies damage.
+	if (FlockParameters.bCanAttackPawn && (!bReplicateFlock || HasAuthority()))
 	{
-		if (FlockMembersDataArr[FlockMemberID].InstanceIndex > StaticMeshInstanceComponent->GetInstanceCount()) continue; // don't do anything if we haven't got an instance in range...
+		for (int AttackedID = 0; AttackedID < StepResult.AttackedActors.Num(); ++AttackedID)
+		{
+			if (IsValid(StepResult.AttackedActors[AttackedID]))
+			{
+				UGameplayStatics::ApplyDamage(StepResult.AttackedActors[AttackedID], FlockParameters.DamageValue,
+											nullptr, this, FlockParameters.DamageType);	
+			}
+		}
+	}
+}
 
-		FTransform InterpFlockTransform;
+void AFlockSystemActor::StartSimulationStep(float DeltaTime, int32 NumSubsteps)
+{
+	// Flock subsystem starts queued steps of all flocks after actors ticked.
+	if (bRegisteredInSubsystem)
+	{
+		Simulation->QueueStep(DeltaTime, NumSubsteps);
+	}
+	else
+	{
+		Simulation->StartStep(DeltaTime, NumSubsteps);
+	}
+}
 
-		// Interpolate Vector and Rotate
-		FVector InterpVector = FMath::VInterpConstantTo(FlockMemberDataArr[FlockMemberID].Transform.GetLocation(),
-		                                                FlockMembersDataArr[FlockMemberID].Transform.GetLocation(), DeltaTime, InterpMoveAnimRate);
+void AFlockSystemActor::WaitForFlockStep()
+{
+	if (Simulation)
+	{
+		Simulation->EnsureCompletion();
+	}
+}
+
+void AFlockSystemActor::GenerateFlockSimulation()
+{
+	Simulation = new FlockSimulation();
+	Simulation->InitFlockParameters(FlockMembers, NumFlockGroups, FlockParameters);
 
-		// FRotator InterpRotator = FMath::RInterpTo(FlockMemberDataArr[flockMemberID_].Transform.Rotator(),
-		//                                           flockMembersDataArr_[flockMemberID_].Transform.Rotator(), DeltaTime, interpRotateAnimRate);
+	BakeAvoidanceField();
+}
 
-		InterpFlockTransform.SetLocation(InterpVector);
-		InterpFlockTransform.SetRotation(FQuat(FlockMembersDataArr[FlockMemberID].Transform.Rotator()));
-		FlockMemberDataArr[FlockMemberID].Transform.SetLocation(InterpVector);
-		FlockMemberDataArr[FlockMemberID].Transform.SetRotation(FQuat(FlockMembersDataArr[FlockMemberID].Transform.Rotator()));
+void AFlockSystemActor::UpdateWorldSnapshot()
+{
+	WorldSnapshot.DangerLocations.Reset();
+	WorldSnapshot.DangerActors.Reset();
 
-		StaticMeshInstanceComponent->UpdateInstanceTransform(FlockMemberDataArr[FlockMemberID].InstanceIndex, FlockMemberDataArr[FlockMemberID].Transform, true, false);
+	for (AActor* DangerActor : IsReplicatedClient() ? ReplicatedDangerActors : DangerActors)
+	{
+		if (DangerActor)
+		{
+			WorldSnapshot.DangerLocations.Add(DangerActor->GetActorLocation());
+			WorldSnapshot.DangerActors.Add(DangerActor);
+		}
+	}
+
+	WorldSnapshot.bHasFollowActor = FlockParameters.FollowActor != nullptr;
+	WorldSnapshot.FollowLocation = WorldSnapshot.bHasFollowActor ? FlockParameters.FollowActor->GetActorLocation() : FVector::ZeroVector;
+	WorldSnapshot.AquariumCenter = BoxComponent->GetComponentLocation();
+	WorldSnapshot.AquariumExtent = BoxComponent->GetScaledBoxExtent();
+	WorldSnapshot.MaxHeight = FlockParameters.MaxHeight;
+
+	// Views of all players, for simulation LOD.
+	WorldSnapshot.ViewLocations.Reset();
+	for (FConstPlayerControllerIterator Iterator = GetWorld()->GetPlayerControllerIterator(); Iterator; ++Iterator)
+	{
+		APlayerController* PlayerController = Iterator->Get();
+		if (PlayerController)
+		{
+			FVector ViewLocation;
+			FRotator ViewRotation;
+			PlayerController->GetPlayerViewPoint(ViewLocation, ViewRotation);
+			WorldSnapshot.ViewLocations.Add(ViewLocation);
+		}
+	}
+
+	// Moving obstacles at their pose of this frame, simple collision bounds or component bounds without it.
+	WorldSnapshot.MovingObstacles.Reset();
+	for (UPrimitiveComponent* Component : MovingAvoidanceComponents)
+	{
+		if (!IsValid(Component)) continue;
+
+		FlockMovingObstacle& Obstacle = WorldSnapshot.MovingObstacles.AddDefaulted_GetRef();
+		UBodySetup* BodySetup = Component->GetBodySetup();
+		if (BodySetup && BodySetup->AggGeom.GetElementCount() > 0)
+		{
+			Obstacle.Transform = Component->GetComponentTransform();
+			Obstacle.LocalBounds = BodySetup->AggGeom.CalcAABB(FTransform::Identity);
+		}
+		else
+		{
+			Obstacle.LocalBounds = Component->Bounds.GetBox();
+		}
+	}
+}
+
+void AFlockSystemActor::UpdateViewFrustums()
+{
+	// Frustums are kept between frames and overwritten in place.
+	NumViewFrustums = 0;
+	if (!bUseViewCulling) return;
+
+	for (FConstPlayerControllerIterator Iterator = GetWorld()->GetPlayerControllerIterator(); Iterator; ++Iterator)
+	{
+		APlayerController* PlayerController = Iterator->Get();
+		if (!PlayerController || !PlayerController->IsLocalController() || !PlayerController->PlayerCameraManager) continue;
+
+		int32 ViewportSizeX = 0;
+		int32 ViewportSizeY = 0;
+		PlayerController->GetViewportSize(ViewportSizeX, ViewportSizeY);
+		if (ViewportSizeX <= 0 || ViewportSizeY <= 0) continue;
+
+		FVector ViewLocation;
+		FRotator ViewRotation;
+		PlayerController->GetPlayerViewPoint(ViewLocation, ViewRotation);
+
+		// Same view and projection as the player camera. Side planes only, far plane is infinite.
+		FMatrix const ViewMatrix = FTranslationMatrix(-ViewLocation) * FInverseRotationMatrix(ViewRotation) * FMatrix(
+			FPlane(0.f, 0.f, 1.f, 0.f),
+			FPlane(1.f, 0.f, 0.f, 0.f),
+			FPlane(0.f, 1.f, 0.f, 0.f),
+			FPlane(0.f, 0.f, 0.f, 1.f));
+		float const HalfFOV = FMath::DegreesToRadians(PlayerController->PlayerCameraManager->GetFOVAngle()) * 0.5f;
+		FMatrix const ProjectionMatrix = FReversedZPerspectiveMatrix(HalfFOV, ViewportSizeX, ViewportSizeY, GNearClippingPlane);
+
+		if (NumViewFrustums == ViewFrustums.Num())
+		{
+			ViewFrustums.AddDefaulted();
+		}
+		GetViewFrustumBounds(ViewFrustums[NumViewFrustums++], ViewMatrix * ProjectionMatrix, false);
+	}
+}
+
+bool AFlockSystemActor::IsInAnyViewFrustum(const FVector& Location, float Radius) const
+{
+	for (int32 FrustumIndex = 0; FrustumIndex < NumViewFrustums; ++FrustumIndex)
+	{
+		if (ViewFrustums[FrustumIndex].IntersectSphere(Location, Radius))
+		{
+			return true;
+		}
+	}
+	for (FConvexVolume const& ExtraViewFrustum : ExtraViewFrustums)
+	{
+		if (ExtraViewFrustum.IntersectSphere(Location, Radius))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void AFlockSystemActor::BakeAvoidanceField()
+{
+	// Overlapping components and root components of avoidance actors. Static ones are baked, the others would be baked
+	// at their pose of this bake only, so steps avoid them live by their collision bounds.
+	TArray<UPrimitiveComponent*> Components;
+	MovingAvoidanceComponents.Reset();
+	FBox Bounds = BoxComponent->Bounds.GetBox();
+	float const MaxDistance = FlockParameters.AvoidancePrimitiveDistance + FlockParameters.AvoidanceFieldVoxelSize;
+
+	if (FlockParameters.bAutoAddComponentsInArray)
+	{
+		for (UPrimitiveComponent* Component : AllOverlappingComponentsArr)
+		{
+			if (!Component) continue;
+
+			if (Component->Mobility == EComponentMobility::Static)
+			{
+				Components.Add(Component);
+			}
+			else
+			{
+				MovingAvoidanceComponents.AddUnique(Component);
+			}
+		}
+	}
+	for (AActor* AvoidanceActor : AvoidanceActorRootArr)
+	{
+		UPrimitiveComponent* PrimComp = AvoidanceActor ? Cast<UPrimitiveComponent>(AvoidanceActor->GetRootComponent()) : nullptr;
+		if (!PrimComp) continue;
 
-		// Attack Pawn.
-		if (FlockParameters.bCanAttackPawn)
+		if (PrimComp->Mobility == EComponentMobility::Static)
 		{
-			for (int AttackedID = 0; AttackedID < FlockMembersDataArr[FlockMemberID].AttackedActors.Num(); ++AttackedID)
-			{
-				if (FlockMembersDataArr[FlockMemberID].AttackedActors[AttackedID])
-				{
-					UGameplayStatics::ApplyDamage(FlockMembersDataArr[FlockMemberID].AttackedActors[AttackedID], FlockParameters.DamageValue,
-												nullptr, this, FlockParameters.DamageType);	
-				}
-			}
+			Components.AddUnique(PrimComp);
+			// Avoidance actors may be outside of the box.
+			Bounds += PrimComp->Bounds.GetBox().ExpandBy(MaxDistance);
+		}
+		else
+		{
+			MovingAvoidanceComponents.AddUnique(PrimComp);
 		}
 	}
 
-	StaticMeshInstanceComponent->MarkRenderStateDirty();
-}
+	// One bake at a time, obstacles changed during a bake are picked up by the next call.
+	if (AvoidanceBakeTask.IsValid()) return;
 
-void AFlockSystemActor::GenerateFlockThread()
-{
-	if (MaxUseThreads > FlockMateInstances)
+	// Bake only when obstacles changed. Sorted, overlaps come in any order.
+	Algo::Sort(Components);
+	if (Components == AvoidanceFieldComponents) return;
+	AvoidanceFieldComponents = Components;
+
+	// Collision captured on game thread, body setups stay referenced until the bake is done.
+	TArray<FlockObstacle> Obstacles;
+	AvoidanceBakeBodySetups.Reset();
+	for (UPrimitiveComponent* Component : Components)
 	{
-		FlockActorPoolThreadArr.Add(new FlockThread(this));
-		FlockActorPoolThreadArr[0]->InitFlockParameters(AllFlockMembersArrays[0].FlockMembersArr, FlockParameters, BoxComponent);
-		FlockActorPoolThreadArr[0]->SetPoolThread(FlockActorPoolThreadArr);
-		FlockActorPoolThreadArr[0]->InitFlockLeader();
-		if (AvoidanceActorRootArr.Num() > 0)
+		UBodySetup* BodySetup = Component->GetBodySetup();
+		if (!BodySetup || BodySetup->AggGeom.GetElementCount() == 0)
 		{
-			FlockActorPoolThreadArr[0]->SetAvoidanceActor(AvoidanceActorRootArr);
+			UE_LOG(LogFlockSystem, Log, TEXT("%s has no simple collision, it is not baked into avoidance field."), *Component->GetPathName());
+			continue;
 		}
+
+		FlockObstacle& Obstacle = Obstacles.AddDefaulted_GetRef();
+		Obstacle.BodySetup = BodySetup;
+		Obstacle.Transform = Component->GetComponentTransform();
+		Obstacle.LocalBounds = BodySetup->AggGeom.CalcAABB(FTransform::Identity);
+		Obstacle.Bounds = Component->Bounds.GetBox();
+		AvoidanceBakeBodySetups.Add(BodySetup);
+	}
+
+	if (Obstacles.Num() == 0)
+	{
+		AvoidanceField.Reset();
+		bAvoidanceDirty = true;
 		return;
 	}
-	for (int i = 0; i < MaxUseThreads; i++)
+
+	// Bake on a background worker. Steps keep sampling the old field until Tick swaps in the new one.
+	BakingAvoidanceField = MakeShared<FlockDistanceField, ESPMode::ThreadSafe>();
+	float const VoxelSize = FlockParameters.AvoidanceFieldVoxelSize;
+	AvoidanceBakeTask = FFunctionGraphTask::CreateAndDispatchWhenReady([Field = BakingAvoidanceField, Obstacles = MoveTemp(Obstacles), Bounds, VoxelSize, MaxDistance]()
 	{
-		FlockActorPoolThreadArr.Add(new FlockThread(this));
-		FlockActorPoolThreadArr[i]->InitFlockParameters(AllFlockMembersArrays[i].FlockMembersArr, FlockParameters, BoxComponent);
+		Field->Bake(Bounds, VoxelSize, MaxDistance, Obstacles);
+	}, TStatId(), nullptr, ENamedThreads::AnyBackgroundThreadNormalTask);
+}
 
-		if (AvoidanceActorRootArr.Num() > 0)
-		{
-			FlockActorPoolThreadArr[i]->SetAvoidanceActor(AvoidanceActorRootArr);
-		}
+void AFlockSystemActor::FinishAvoidanceBake(bool bWait)
+{
+	if (!AvoidanceBakeTask.IsValid()) return;
+
+	if (!AvoidanceBakeTask->IsComplete())
+	{
+		if (!bWait) return;
+		FTaskGraphInterface::Get().WaitUntilTaskCompletes(AvoidanceBakeTask);
 	}
 
-	// Set pool thread for control flock from first thread.
-	for (int i = 0; i < FlockActorPoolThreadArr.Num(); i++)
+	AvoidanceBakeTask = nullptr;
+	AvoidanceField = BakingAvoidanceField;
+	BakingAvoidanceField.Reset();
+	AvoidanceBakeBodySetups.Reset();
+	bAvoidanceDirty = true;
+}
+
+void AFlockSystemActor::WaitForAvoidanceBake()
+{
+	FinishAvoidanceBake(true);
+}
+
+SIZE_T AFlockSystemActor::GetFlockAllocatedSize() const
+{
+	SIZE_T Size = FlockMembers.GetAllocatedSize() + RenderedLocations.GetAllocatedSize() + InstanceStates.GetAllocatedSize() + InstanceDirty.GetAllocatedSize()
+		+ AnimationPhases.GetAllocatedSize() + InstanceAnimationData.GetAllocatedSize() + InstanceTransforms.GetAllocatedSize()
+		+ ActiveSlots.GetAllocatedSize() + FreeSlots.GetAllocatedSize() + PendingMemberCommands.GetAllocatedSize();
+	if (Simulation)
 	{
-		FlockActorPoolThreadArr[i]->SetPoolThread(FlockActorPoolThreadArr);
+		Size += Simulation->GetAllocatedSize();
 	}
-	if (FlockParameters.bUseOneLeader)
+	if (AvoidanceField.IsValid())
 	{
-		for (int i = 0; i < FlockActorPoolThreadArr.Num(); i++)
-		{
-			FlockActorPoolThreadArr[i]->InitFlockLeader();
-		}
+		Size += AvoidanceField->GetAllocatedSize();
 	}
+	return Size;
 }
 
 void AFlockSystemActor::AddAvoidanceComponentsTimer()
 {
 	if (FlockParameters.bAutoAddComponentsInArray)
 	{
-		AllOverlappingComponentsArr.Empty();
-		DangerActors.Empty();
+		AllOverlappingComponentsArr.Reset();
+		DangerActors.Reset();
 
 		TArray<UPrimitiveComponent*> OverlappingComponentsArr;
 
@@ -585,420 +1536,769 @@ void AFlockSystemActor::AddAvoidanceComponentsTimer()
 		}
 	}
 
-	for (int i = 0; i < FlockActorPoolThreadArr.Num(); i++)
-	{
-		if (FlockActorPoolThreadArr[i])
-		{
-			FlockActorPoolThreadArr[i]->SetOverlappingComponents(AllOverlappingComponentsArr, DangerActors);
-		}
-	}
+	BakeAvoidanceField();
+
+	// Step may be running, simulation takes them in next Tick.
+	bAvoidanceDirty = true;
 }
 
-FVector FlockThread::SteeringAquarium(FlockMemberData& FlockMember) const
+FVector FlockSimulation::SteeringAquarium(int32 FlockMember) const
 {
-	FRotator const RotationToCenter(UKismetMathLibrary::FindLookAtRotation(FlockMember.Transform.GetLocation(), BoxComponentRef->GetComponentLocation()));
-	FVector Direction = UKismetMathLibrary::Conv_RotatorToVector(RotationToCenter);
-	Direction.Normalize();
+	FVector const Direction = (WorldSnapshotTHR.AquariumCenter - StepMembers->GetLocation(FlockMember)).GetSafeNormal();
 	FVector NewVec = Direction * ((FlockParametersTHR.FlockEnemyAwarenessRadius / FlockParametersTHR.StrengthAquariumOffsetValue) * FlockParametersTHR.FleeScaleAquarium);
 	return NewVec;
 }
 
-FVector FlockThread::SteeringAvoidanceComponent(FlockMemberData& FlockMember) const
+FVector FlockSimulation::SteeringAvoidanceField(int32 FlockMember) const
 {
-	FVector NewVec(FVector::ZeroVector);
+	float Distance;
+	FVector Gradient;
 
-	for (int i = 0; i < AllOverlappingComponentsArrTHR.Num(); ++i)
+	if (!AvoidanceFieldTHR->Sample(StepMembers->GetLocation(FlockMember), Distance, Gradient) || Distance >= FlockParametersTHR.AvoidancePrimitiveDistance)
 	{
-		if (AllOverlappingComponentsArrTHR[i])
-		{
-			UPrimitiveComponent* PrimComp(Cast<UPrimitiveComponent>(AllOverlappingComponentsArrTHR[i]));
-			if (PrimComp)
-			{
-				FVector ClosestPoint;
-				PrimComp->GetClosestPointOnCollision(FlockMember.Transform.GetLocation(), ClosestPoint);
+		return FVector::ZeroVector;
+	}
 
-				if ((ClosestPoint - FlockMember.Transform.GetLocation()).Size() < FlockParametersTHR.AvoidancePrimitiveDistance)
-				{
-					FRotator const RotationToCenter(UKismetMathLibrary::FindLookAtRotation(ClosestPoint, FlockMember.Transform.GetLocation()));
-					FVector Direction = UKismetMathLibrary::Conv_RotatorToVector(RotationToCenter);
-					Direction.Normalize();
+	// Gradient points away from the closest obstacle, out of it for members inside. Flat deep inside large obstacles.
+	FVector const Direction = Gradient.GetSafeNormal();
+	if (Direction.IsZero()) return FVector::ZeroVector;
 
-					NewVec = Direction * ((FlockParametersTHR.FlockEnemyAwarenessRadius / FlockParametersTHR.StrengthAquariumOffsetValue) * FlockParametersTHR.FleeScaleAquarium);
-				}
-			}
-		}
+	FVector NewVec = Direction * ((FlockParametersTHR.FlockEnemyAwarenessRadius / FlockParametersTHR.StrengthAquariumOffsetValue) * FlockParametersTHR.FleeScaleAquarium);
+	return NewVec;
+}
+
+FVector FlockSimulation::SteeringMovingObstacles(int32 FlockMember) const
+{
+	FVector const Location = StepMembers->GetLocation(FlockMember);
+	float ClosestDistanceSquared = FMath::Square(FlockParametersTHR.AvoidancePrimitiveDistance);
+	FVector Direction = FVector::ZeroVector;
+
+	for (FlockMovingObstacle const& Obstacle : WorldSnapshotTHR.MovingObstacles)
+	{
+		// Closest point of the bounds box in obstacle space.
+		FVector const LocalLocation = Obstacle.Transform.InverseTransformPosition(Location);
+		FVector const ClosestPoint = Obstacle.Transform.TransformPosition(LocalLocation.BoundToBox(Obstacle.LocalBounds.Min, Obstacle.LocalBounds.Max));
+		FVector const Away = Location - ClosestPoint;
+		float const DistanceSquared = Away.SizeSquared();
+		if (DistanceSquared >= ClosestDistanceSquared) continue;
+
+		// Inside the bounds, away from their center.
+		ClosestDistanceSquared = DistanceSquared;
+		Direction = DistanceSquared > SMALL_NUMBER ? Away : Location - Obstacle.Transform.TransformPosition(Obstacle.LocalBounds.GetCenter());
 	}
 
+	Direction = Direction.GetSafeNormal();
+	if (Direction.IsZero()) return FVector::ZeroVector;
+
+	FVector NewVec = Direction * ((FlockParametersTHR.FlockEnemyAwarenessRadius / FlockParametersTHR.StrengthAquariumOffsetValue) * FlockParametersTHR.FleeScaleAquarium);
 	return NewVec;
 }
 
-FVector FlockThread::SteeringWander(FlockMemberData& FlockMember) const
+FVector FlockSimulation::SteeringWander(int32 FlockMember, FVector4& WanderTarget, FRandomStream& Random) const
 {
-	FVector NewVec = FlockMember.WanderPosition - FlockMember.Transform.GetLocation();
+	// Wander location in XYZ, elapsed time since last wander in W.
+	FVector NewVec = FVector(WanderTarget.X, WanderTarget.Y, WanderTarget.Z) - StepMembers->GetLocation(FlockMember);
 
-	if (FlockMember.ElapsedTimeSinceLastWander >= FlockParametersTHR.FlockWanderUpdateRate || NewVec.Size() <= FlockParametersTHR.FlockMinWanderDistance)
+	if (WanderTarget.W >= FlockParametersTHR.FlockWanderUpdateRate || NewVec.SizeSquared() <= FMath::Square(FlockParametersTHR.FlockMinWanderDistance))
 	{
-		FlockMember.WanderPosition = GetRandomWanderLocation(); // + GetActorLocation();
-		FlockMember.ElapsedTimeSinceLastWander = 0.0f;
-		NewVec = FlockMember.WanderPosition - FlockMember.Transform.GetLocation();
+		FVector const WanderPosition = GetRandomWanderLocation(Random); // + GetActorLocation();
+		WanderTarget = FVector4(WanderPosition, 0.0f);
+		NewVec = WanderPosition - StepMembers->GetLocation(FlockMember);
 	}
 	return NewVec;
 }
 
-FVector FlockThread::SteeringAlign(FlockMemberData& FlockMember, TArray<int32>& FlockMates)
+void FlockSimulation::AccumulateFlockMates(int32 FlockMember, const TArray<int32>& FlockMates, FlockMatesSums& OutSums) const
 {
-	FVector Vel = FVector(0, 0, 0);
-	if (FlockMates.Num() == 0) return Vel;
-
-	for (int32 i = 0; i < FlockMates.Num(); i++)
+	if (FlockSteering::UseVectorizedSteering())
 	{
-		Vel += FlockThreadMembersArr[FlockMates[i]].Velocity;
+		FlockSteering::AccumulateMates(StepMembers->Positions.GetData(), StepMembers->Velocities.GetData(), FlockMates.GetData(), FlockMates.Num(),
+		                               StepMembers->GetLocation(FlockMember), OutSums);
 	}
-	Vel /= (float)FlockMates.Num();
+	else
+	{
+		FlockSteering::AccumulateMatesScalar(StepMembers->Positions.GetData(), StepMembers->Velocities.GetData(), FlockMates.GetData(), FlockMates.Num(),
+		                                     StepMembers->GetLocation(FlockMember), OutSums);
+	}
+}
+
+FVector FlockSimulation::SteeringAlign(int32 FlockMember, const FlockMatesSums& MatesSums) const
+{
+	FVector Vel = FVector(0, 0, 0);
+	if (MatesSums.Num == 0) return Vel;
+
+	Vel = MatesSums.Velocity / (float)MatesSums.Num;
 
 	return Vel;
 }
 
-FVector FlockThread::SteeringSeparate(FlockMemberData& FlockMember, TArray<int32>& FlockMates)
+FVector FlockSimulation::SteeringSeparate(int32 FlockMember, const FlockMatesSums& MatesSums) const
 {
 	FVector Force = FVector(0, 0, 0);
-	if (FlockMates.Num() == 0) return Force;
+	if (MatesSums.Num == 0) return Force;
+
+	// Sum of normalized differences scaled by SeparationRadius / Distance.
+	Force = MatesSums.Separation * FlockParametersTHR.SeparationRadius;
 
-	for (int32 i = 0; i < FlockMates.Num(); i++)
-	{
-		FVector Diff = FlockMember.Transform.GetLocation() - FlockThreadMembersArr[FlockMates[i]].Transform.GetLocation();
-		float const Scale = Diff.Size();
-		Diff.Normalize();
-		Diff = Diff * (FlockParametersTHR.SeparationRadius / Scale);
-		Force += Diff;
-	}
 	return Force;
 }
 
-FVector FlockThread::SteeringCohesion(FlockMemberData& FlockMember, TArray<int32>& FlockMates)
+FVector FlockSimulation::SteeringCohesion(int32 FlockMember, const FlockMatesSums& MatesSums) const
 {
 	FVector AvgPos = FVector(0, 0, 0);
-	if (FlockMates.Num() == 0) return AvgPos;
-
-	for (int32 i = 0; i < FlockMates.Num(); i++)
-	{
-		AvgPos += FlockThreadMembersArr[FlockMates[i]].Transform.GetLocation();
-	}
+	if (MatesSums.Num == 0) return AvgPos;
 
-	AvgPos /= (float)FlockMates.Num();
+	AvgPos = MatesSums.Position / (float)MatesSums.Num;
 
-	return AvgPos - FlockMember.Transform.GetLocation();
+	return AvgPos - StepMembers->GetLocation(FlockMember);
 }
 
-FVector FlockThread::SteeringFlee(FlockMemberData& FlockMember)
+FVector FlockSimulation::SteeringFlee(int32 FlockMember) const
 {
 	FVector NewVec = FVector(0, 0, 0);
 
-	for (int i = 0; i < DangerActorsTHR.Num(); ++i)
+	for (int i = 0; i < WorldSnapshotTHR.DangerLocations.Num(); ++i)
 	{
-		if (DangerActorsTHR[i])
-		{
-			// calculate flee from this threat
-			FVector FromEnemy = FlockMember.Transform.GetLocation() - DangerActorsTHR[i]->GetActorLocation();
-			float const DistanceToEnemy = FromEnemy.Size();
-			FromEnemy.Normalize();
+		// calculate flee from this threat
+		FVector const FromEnemy = StepMembers->GetLocation(FlockMember) - WorldSnapshotTHR.DangerLocations[i];
+		float const DistanceSquared = FromEnemy.SizeSquared();
 
-			// enemy inside our enemy awareness threshold, so evade them
-			if (DistanceToEnemy < FlockParametersTHR.FlockEnemyAwarenessRadius)
-			{
-				NewVec += FromEnemy * ((FlockParametersTHR.FlockEnemyAwarenessRadius / DistanceToEnemy) * FlockParametersTHR.FleeScale);
-			}
+		// enemy inside our enemy awareness threshold, so evade them
+		// Direction * (Radius / Distance) is FromEnemy * (Radius / Distance^2), no square root.
+		if (DistanceSquared < FMath::Square(FlockParametersTHR.FlockEnemyAwarenessRadius) && DistanceSquared > SMALL_NUMBER)
+		{
+			NewVec += FromEnemy * ((FlockParametersTHR.FlockEnemyAwarenessRadius / DistanceSquared) * FlockParametersTHR.FleeScale);
 		}
 	}
 	return NewVec;
 }
 
-FVector FlockThread::GetRandomWanderLocation() const
+FVector FlockSimulation::SteeringInteraction(int32 FlockMember) const
 {
-	FVector ReturnVector;
+	FVector const Location = StepMembers->GetLocation(FlockMember);
+	FVector NewVec = FVector::ZeroVector;
+
+	// Nearest member to chase.
+	float ChaseDistanceSquared = MAX_flt;
+	FVector ChaseLocation = FVector::ZeroVector;
+	float ChaseScale = 0.f;
 
-	if (FlockParametersTHR.bUseAquarium)
+	// Only flocks with a rule, each within its own rule radius.
+	for (int32 Index = 0; Index < InteractionFlocks.Num(); ++Index)
 	{
-		ReturnVector = UKismetMathLibrary::RandomPointInBoundingBox(BoxComponentRef->GetComponentLocation(), BoxComponentRef->GetScaledBoxExtent());
+		FlockInteractionRule const& Rule = FlockParametersTHR.InteractionRules[InteractionFlockRules[Index]];
+
+		SharedIndexTHR->ForEachInRadius(InteractionFlocks[Index], Location, Rule.Radius, [&](const FVector& OtherLocation)
+		{
+			FVector const FromOther = Location - OtherLocation;
+			float const DistanceSquared = FromOther.SizeSquared();
+			if (DistanceSquared <= SMALL_NUMBER) return;
+
+			switch (Rule.Interaction)
+			{
+			case EFlockInteraction::Flee:
+				// Same as flee from danger actors.
+				NewVec += FromOther * ((Rule.Radius / DistanceSquared) * Rule.Scale);
+				break;
+			case EFlockInteraction::Avoid:
+				// Direction * (1 - Distance / Radius), zero at rule radius.
+				NewVec += FromOther * ((FMath::InvSqrt(DistanceSquared) - 1.f / Rule.Radius) * Rule.Scale);
+				break;
+			case EFlockInteraction::Chase:
+				if (DistanceSquared < ChaseDistanceSquared)
+				{
+					ChaseDistanceSquared = DistanceSquared;
+					ChaseLocation = OtherLocation;
+					ChaseScale = Rule.Scale;
+				}
+				break;
+			}
+		});
 	}
-	else
+
+	// Seek like follow to pawn.
+	if (ChaseScale > 0.f)
 	{
-		ReturnVector = (BoxComponentRef->GetComponentLocation() + FVector(FMath::RandRange(-FlockParametersTHR.FlockWanderInRandomRadius, FlockParametersTHR.FlockWanderInRandomRadius),
-		                                                                   FMath::RandRange(-FlockParametersTHR.FlockWanderInRandomRadius, FlockParametersTHR.FlockWanderInRandomRadius),
-		                                                                   FMath::RandRange(-FlockParametersTHR.FlockWanderInRandomRadius, FlockParametersTHR.FlockWanderInRandomRadius)));
+		NewVec += ((ChaseLocation - Location).GetSafeNormal() * FlockParametersTHR.FlockMaxSpeed - StepMembers->GetVelocity(FlockMember)) * ChaseScale;
 	}
 
+	return NewVec;
+}
+
+FVector FlockSimulation::GetRandomWanderLocation(FRandomStream& Random) const
+{
+	// Random point in box, like RandomPointInBoundingBox but from member stream.
+	FVector const Extent = FlockParametersTHR.bUseAquarium ? WorldSnapshotTHR.AquariumExtent : FVector(FlockParametersTHR.FlockWanderInRandomRadius);
+	FVector ReturnVector = WorldSnapshotTHR.AquariumCenter + FVector(Random.FRandRange(-Extent.X, Extent.X),
+	                                                                 Random.FRandRange(-Extent.Y, Extent.Y),
+	                                                                 Random.FRandRange(-Extent.Z, Extent.Z));
+
 	if (FlockParametersTHR.bUseMaxHeight)
 	{
-		if (ReturnVector.Z >= FlockParametersTHR.MaxHeight)
+		if (ReturnVector.Z >= WorldSnapshotTHR.MaxHeight)
 		{
-			ReturnVector.Z = FlockParametersTHR.MaxHeight - 50.f;
+			ReturnVector.Z = WorldSnapshotTHR.MaxHeight - 50.f;
 		}
 	}
 
 	return ReturnVector;
 }
 
-FVector FlockThread::SteeringFollow(FlockMemberData& FlockMember, int32 FlockLeader)
+FVector FlockSimulation::SteeringFollow(int32 FlockMember, int32 FlockLeader, TArray<AActor*>& OutAttackedActors) const
 {
 	bool bIsFollowToEnemy(false);
 	FVector NewVec = FVector::ZeroVector;
 
-	FlockMemberData NewFlockLeader;
-	if (FlockParametersTHR.bUseOneLeader)
-	{
-		NewFlockLeader = PoolThreadArr[0]->FlockThreadMembersArr[FlockLeader];
-	}
-	else
-	{
-		NewFlockLeader = FlockThreadMembersArr[FlockLeader];
-	}
-
 	// Follow to pawn
 	if (FlockParametersTHR.bFollowToPawn)
 	{
-		for (int i = 0; i < DangerActorsTHR.Num(); ++i)
+		for (int i = 0; i < WorldSnapshotTHR.DangerLocations.Num(); ++i)
 		{
-			if (DangerActorsTHR[i])
+			FVector const& DangerLocation = WorldSnapshotTHR.DangerLocations[i];
+
+			// calculate flee from this threat
+			FVector const ToEnemy = DangerLocation - StepMembers->GetLocation(FlockMember);
+			float const DistanceSquared = ToEnemy.SizeSquared();
+
+			// enemy inside our enemy awareness threshold, so evade them
+			if (DistanceSquared < FMath::Square(FlockParametersTHR.FollowPawnAwarenessRadius))
 			{
-				// calculate flee from this threat
-				FVector FromEnemy = DangerActorsTHR[i]->GetActorLocation() - FlockMember.Transform.GetLocation();
-				float const DistanceToEnemy = FromEnemy.Size();
-				FromEnemy.Normalize();
-	
-				// enemy inside our enemy awareness threshold, so evade them
-				if (DistanceToEnemy < FlockParametersTHR.FollowPawnAwarenessRadius)
+				NewVec = ToEnemy.GetSafeNormal() * FlockParametersTHR.FlockMaxSpeed;
+				NewVec -= StepMembers->GetVelocity(FlockMember);
+
+				// Add attacked actors in array. Actor is only passed back to game thread.
+				if (FlockParametersTHR.bCanAttackPawn)
 				{
-					NewVec = DangerActorsTHR[i]->GetActorLocation() - FlockMember.Transform.GetLocation();
-					NewVec.Normalize();
-					NewVec *= FlockParametersTHR.FlockMaxSpeed;
-					NewVec -= FlockMember.Velocity;
-	
-					// Add attacked actors in array.
-					if (FlockParametersTHR.bCanAttackPawn)
+					if (DistanceSquared < FlockParametersTHR.AttackRadiusSquared)
 					{
-						if ((DangerActorsTHR[i]->GetActorLocation() - FlockMember.Transform.GetLocation()).SizeSquared() < FlockParametersTHR.AttackRadiusSquared)
-						{
-							FlockMember.AttackedActors.AddUnique(DangerActorsTHR[i]);
-						}
-						
-						// UPrimitiveComponent* primComp_(Cast<UPrimitiveComponent>(DangerActorsTHR[i]->GetRootComponent()));
-						// if (primComp_)
-						// {							
-						// 	FVector closestPoint_;
-						// 	primComp_->GetClosestPointOnCollision(FlockMember.Transform.GetLocation(), closestPoint_);
-						//
-						// 	if ((closestPoint_ - FlockMember.Transform.GetLocation()).SizeSquared() < FlockParametersTHR.AttackRadiusSquared)
-						// 	{								
-						// 		FlockMember.AttackedActors.AddUnique(DangerActorsTHR[i]);
-						// 	}
-						// }
+						OutAttackedActors.Add(WorldSnapshotTHR.DangerActors[i]);
 					}
-	
-					bIsFollowToEnemy = true;
-					break;
 				}
+
+				bIsFollowToEnemy = true;
+				break;
 			}
 		}
 	}
 
 	if (!bIsFollowToEnemy)
 	{
-		if (FlockParametersTHR.FollowActor)
+		if (WorldSnapshotTHR.bHasFollowActor)
 		{
-			NewVec = FlockParametersTHR.FollowActor->GetActorLocation() - FlockMember.Transform.GetLocation();
+			NewVec = WorldSnapshotTHR.FollowLocation - StepMembers->GetLocation(FlockMember);
 			NewVec.Normalize();
 			NewVec *= FlockParametersTHR.FlockMaxSpeed;
-			NewVec -= FlockMember.Velocity;
+			NewVec -= StepMembers->GetVelocity(FlockMember);
 		}
-		else if (FlockLeader <= FlockThreadMembersArr.Num() && FlockLeader >= 0)
+		else if (FlockLeader < StepMembers->Num() && FlockLeader >= 0)
 		{
-			NewVec = NewFlockLeader.Transform.GetLocation() - FlockMember.Transform.GetLocation();
+			NewVec = StepMembers->GetLocation(FlockLeader) - StepMembers->GetLocation(FlockMember);
 			NewVec.Normalize();
 			NewVec *= FlockParametersTHR.FlockMaxSpeed;
-			NewVec -= FlockMember.Velocity;
+			NewVec -= StepMembers->GetVelocity(FlockMember);
 		}
 	}
 
 	return NewVec;
 }
 
-FVector FlockThread::SteeringMaxHeight(FlockMemberData& FlockMember) const
+FVector FlockSimulation::SteeringMaxHeight(int32 FlockMember) const
 {
-	FRotator const RotationToDeep(UKismetMathLibrary::FindLookAtRotation(FlockMember.Transform.GetLocation(),
-	                                                                      FVector(BoxComponentRef->GetComponentLocation().X, BoxComponentRef->GetComponentLocation().Y, FlockParametersTHR.MaxHeight)));
-	FVector Direction = UKismetMathLibrary::Conv_RotatorToVector(RotationToDeep);
-	Direction.Normalize();
+	FVector const Deep(WorldSnapshotTHR.AquariumCenter.X, WorldSnapshotTHR.AquariumCenter.Y, WorldSnapshotTHR.MaxHeight);
+	FVector const Direction = (Deep - StepMembers->GetLocation(FlockMember)).GetSafeNormal();
 	FVector NewVec = Direction * ((FlockParametersTHR.FlockEnemyAwarenessRadius / FlockParametersTHR.StrengthAquariumOffsetValue) * FlockParametersTHR.FleeScaleAquarium);
 	return NewVec;
 }
 
-FVector FlockThread::SteeringFollowPawn(FlockMemberData& FlockMember)
+FVector FlockSimulation::SteeringFollowPawn(int32 FlockMember, TArray<AActor*>& OutAttackedActors) const
 {
 	FVector NewVec = FVector(0, 0, 0);
 
-	for (int i = 0; i < DangerActorsTHR.Num(); ++i)
+	for (int i = 0; i < WorldSnapshotTHR.DangerLocations.Num(); ++i)
 	{
-		if (DangerActorsTHR[i])
-		{
-			// calculate flee from this threat
-			FVector FromEnemy = DangerActorsTHR[i]->GetActorLocation() - FlockMember.Transform.GetLocation();
-			float const DistanceToEnemy = FromEnemy.Size();
-			FromEnemy.Normalize();
+		// calculate flee from this threat
+		FVector const FromEnemy = WorldSnapshotTHR.DangerLocations[i] - StepMembers->GetLocation(FlockMember);
+		float const DistanceSquared = FromEnemy.SizeSquared();
 
-			// enemy inside our enemy awareness threshold, so evade them
-			if (DistanceToEnemy < FlockParametersTHR.FollowPawnAwarenessRadius)
-			{
-				NewVec += FromEnemy * ((FlockParametersTHR.FollowPawnAwarenessRadius / DistanceToEnemy) * FlockParametersTHR.FleeScale);
-			}
-
-			// Add attacked actors in array.
-			if (FlockParametersTHR.bCanAttackPawn && DistanceToEnemy)
-			{
-				UPrimitiveComponent* PrimComp(Cast<UPrimitiveComponent>(DangerActorsTHR[i]->GetRootComponent()));
-				if (PrimComp)
-				{
-					FVector ClosestPoint;
-					PrimComp->GetClosestPointOnCollision(FlockMember.Transform.GetLocation(), ClosestPoint);
+		// enemy inside our enemy awareness threshold, so evade them
+		if (DistanceSquared < FMath::Square(FlockParametersTHR.FollowPawnAwarenessRadius) && DistanceSquared > SMALL_NUMBER)
+		{
+			NewVec += FromEnemy * ((FlockParametersTHR.FollowPawnAwarenessRadius / DistanceSquared) * FlockParametersTHR.FleeScale);
+		}
 
-					if ((ClosestPoint - FlockMember.Transform.GetLocation()).Size() < FlockParametersTHR.AttackRadius)
-					{
-						FlockMember.AttackedActors.AddUnique(DangerActorsTHR[i]);
-					}
-				}
-			}
+		// Add attacked actors in array. Distance to actor location, collision is not queried off game thread.
+		if (FlockParametersTHR.bCanAttackPawn && DistanceSquared < FMath::Square(FlockParametersTHR.AttackRadius))
+		{
+			OutAttackedActors.Add(WorldSnapshotTHR.DangerActors[i]);
 		}
 	}
 	return NewVec;
 }
 
-void FlockThread::InitFlockLeader()
+void AFlockSystemActor::AddFlockMemberWorldSpace(const FTransform& WorldTransform, bool bActive)
 {
-	if (FlockParametersTHR.FollowActor)
+	StaticMeshInstanceComponent->AddInstanceWorldSpace(WorldTransform);
+
+	//   flockMember_.Velocity = flockMember_.WanderPosition - flockMember_.Transform.GetLocation();
+	// Own random stream of every member, seeded from actor seed.
+	int32 const MemberSeed = int32(HashCombine(GetTypeHash(SimulationSeed), GetTypeHash(NumFlock)));
+	FlockMembers.Add(WorldTransform, NumFlock, bActive ? FlockMemberFlags::Active : FlockMemberFlags::None, MemberSeed);
+	ActiveSlots.Add(bActive);
+	if (bActive)
 	{
-		for (int i = 0; i < PoolThreadArr.Num(); i++)
-		{
-			PoolThreadArr[i]->FlockThreadMembersArr[0].bIsFlockLeader = false;
-		}
+		++NumActiveMembers;
+	}
+	else
+	{
+		FreeSlots.Add(NumFlock);
+	}
+	RenderedLocations.Add(WorldTransform.GetLocation());
+	InstanceStates.Add(FlockInstanceState::Visible);
+	InstanceDirty.Add(false);
+	// Random start phase, so members do not animate in sync.
+	AnimationPhases.Add(SpawnRandom.FRand());
+	InstanceTransforms.Add(WorldTransform.GetRelativeTransform(StaticMeshInstanceComponent->GetComponentTransform()));
+	NumFlock++;
+}
+
+void FlockSimulation::GetNearbyFlockMates(int32 FlockMember, TArray<int32>& OutMates) const
+{
+	OutMates.Reset();
+	if (FlockMember >= StepMembers->Num()) return;
+	if (FlockMember < 0) return;
+
+	if (FlockParametersTHR.MaxFlockMates > 0)
+	{
+		Grid.FindNearest(StepMembers->GetLocation(FlockMember), FlockParametersTHR.FlockMateAwarenessRadius, FlockParametersTHR.MaxFlockMates, FlockMember, OutMates);
+		return;
 	}
-	else if (FlockParametersTHR.bUseOneLeader)
+
+	Grid.ForEachInRadius(StepMembers->GetLocation(FlockMember), FlockParametersTHR.FlockMateAwarenessRadius, [FlockMember, &OutMates](int32 MateID)
 	{
-		for (int i = 0; i < PoolThreadArr.Num(); i++)
+		if (MateID != FlockMember)
 		{
-			PoolThreadArr[i]->FlockThreadMembersArr[0].bIsFlockLeader = false;
+			OutMates.Add(MateID);
 		}
-		PoolThreadArr[0]->FlockThreadMembersArr[0].bIsFlockLeader = true;
-	}
+	});
 }
 
-void FlockThread::SetPoolThread(TArray<FlockThread*> SetPoolThreadArr)
+int32 AFlockSystemActor::SpawnMembers(int32 Count, const FTransform& SpawnTransform, FVector SpawnExtent)
 {
-	PoolThreadArr = SetPoolThreadArr;
+	// Clients of replicated flock get spawns from server.
+	if (!Simulation || IsReplicatedClient()) return 0;
+
+	int32 const NumSpawned = FMath::Clamp(Count, 0, FreeSlots.Num());
+
+	for (int32 i = 0; i < NumSpawned; ++i)
+	{
+		FlockMemberCommand Command;
+		Command.Slot = FreeSlots.Last();
+		Command.Type = FlockMemberCommandType::Spawn;
+		Command.RandomSeed = int32(SpawnRandom.GetUnsignedInt());
+
+		// Random point and yaw in the box, random scale like BeginPlay spawn.
+		FVector const LocalLocation(SpawnRandom.FRandRange(-SpawnExtent.X, SpawnExtent.X),
+		                            SpawnRandom.FRandRange(-SpawnExtent.Y, SpawnExtent.Y),
+		                            SpawnRandom.FRandRange(-SpawnExtent.Z, SpawnExtent.Z));
+		FQuat const Rotation = SpawnTransform.GetRotation() * FQuat(FVector::UpVector, SpawnRandom.FRandRange(-PI, PI));
+		float const RandScale = SpawnRandom.FRandRange(MinMeshScale, MaxMeshScale);
+		Command.Transform = FTransform(Rotation, SpawnTransform.TransformPosition(LocalLocation), FVector(RandScale));
+
+		QueueMemberCommand(Command);
+	}
+
+	return NumSpawned;
 }
 
-FVector FlockThread::SteeringAvoidance(FlockMemberData& FlockMember) const
+int32 AFlockSystemActor::RemoveMembers(const TArray<int32>& InstanceIndices)
 {
-	FVector NewVec(FVector::ZeroVector);
+	if (!Simulation || IsReplicatedClient()) return 0;
 
-	for (int i = 0; i < AvoidanceActorRootArrTHR.Num(); ++i)
+	int32 NumRemoved = 0;
+
+	for (int32 Slot : InstanceIndices)
 	{
-		if (AvoidanceActorRootArrTHR[i])
-		{
-			UPrimitiveComponent* PrimComp(Cast<UPrimitiveComponent>(AvoidanceActorRootArrTHR[i]->GetRootComponent()));
-			if (PrimComp)
-			{
-				FVector ClosestPoint;
-				PrimComp->GetClosestPointOnCollision(FlockMember.Transform.GetLocation(), ClosestPoint);
+		// Slot is the instance index, not active slots are already removed.
+		if (!ActiveSlots.IsValidIndex(Slot) || !ActiveSlots[Slot]) continue;
+
+		FlockMemberCommand Command;
+		Command.Slot = Slot;
+		Command.Type = FlockMemberCommandType::Remove;
+		QueueMemberCommand(Command);
+		++NumRemoved;
+	}
 
-				if ((ClosestPoint - FlockMember.Transform.GetLocation()).Size() < FlockParametersTHR.AvoidancePrimitiveDistance)
-				{
-					FRotator const RotationToCenter(UKismetMathLibrary::FindLookAtRotation(ClosestPoint, FlockMember.Transform.GetLocation()));
-					FVector Direction = UKismetMathLibrary::Conv_RotatorToVector(RotationToCenter);
-					Direction.Normalize();
+	return NumRemoved;
+}
 
-					NewVec = Direction * ((FlockParametersTHR.FlockEnemyAwarenessRadius / FlockParametersTHR.StrengthAquariumOffsetValue) * FlockParametersTHR.FleeScaleAquarium);
-				}
-			}
-		}
+void AFlockSystemActor::QueueMemberCommand(const FlockMemberCommand& Command)
+{
+	int32 const Slot = Command.Slot;
+	bool const bSpawn = Command.Type == FlockMemberCommandType::Spawn;
+	if (!ActiveSlots.IsValidIndex(Slot) || bool(ActiveSlots[Slot]) == bSpawn) return;
+
+	ActiveSlots[Slot] = bSpawn;
+	if (bSpawn)
+	{
+		// Spawn takes the last free slot, search from the end.
+		FreeSlots.RemoveAtSwap(FreeSlots.FindLast(Slot), 1, false);
+		++NumActiveMembers;
 	}
+	else
+	{
+		FreeSlots.Add(Slot);
+		--NumActiveMembers;
+	}
+	PendingMemberCommands.Add(Command);
 
-	return NewVec;
+	if (bReplicateFlock && HasAuthority())
+	{
+		FlockNetMemberCommand& NetCommand = OutgoingNetCommands.AddDefaulted_GetRef();
+		NetCommand.Slot = Slot;
+		NetCommand.bSpawn = bSpawn;
+		NetCommand.Location = Command.Transform.GetLocation();
+		NetCommand.Rotation = Command.Transform.GetRotation();
+		NetCommand.Scale = Command.Transform.GetScale3D().X;
+		NetCommand.RandomSeed = Command.RandomSeed;
+	}
+}
+
+FString AFlockSystemActor::GetSnapshotPath(const FString& FileName)
+{
+	return FPaths::IsRelative(FileName) ? FPaths::ProjectSavedDir() / TEXT("Flock") / FileName : FileName;
+}
+
+bool AFlockSystemActor::SaveFlockSnapshot(const FString& FileName)
+{
+	if (!Simulation) return false;
+
+	// Step result shown by the last Tick, read buffer is owned by game thread. Saved relative to actor, so the snapshot loads into moved actors.
+	FlockMemberStore Members = Simulation->StepBuffers.GetReadBuffer().Members;
+	Members.TransformBy(FTransform(GetActorQuat(), GetActorLocation()).Inverse());
+	return FlockSnapshot::Save(GetSnapshotPath(FileName), Members, SpawnRandom.GetCurrentSeed());
 }
 
-void AFlockSystemActor::DivideFlockArrayForThreads()
+bool AFlockSystemActor::LoadWarmStartSnapshot()
 {
-	TArray<FlockMemberData> TempFlockData;
-	FlockMembersArrays NewFlockData;
+	int32 LoadedSeed = 0;
+	if (!FlockSnapshot::Load(GetSnapshotPath(WarmStartSnapshot), FlockMembers, LoadedSeed)) return false;
+	FlockMembers.TransformBy(FTransform(GetActorQuat(), GetActorLocation()));
 
-	if (MaxUseThreads > FlockMateInstances)
+	// Spawning continues the random sequence of the saved flock, unless seed is set.
+	if (FlockParameters.RandomSeed == 0)
 	{
-		NewFlockData.AddData(0, TempFlockData);
-		AllFlockMembersArrays.Add(NewFlockData);
-		AllFlockMembersArrays[0].FlockMembersArr = FlockMemberDataArr;
-		return;
+		SimulationSeed = LoadedSeed;
+		SpawnRandom.Initialize(SimulationSeed);
 	}
 
-	int FlockID(0);
-	int FlockPart = FlockMemberDataArr.Num() / MaxUseThreads;
-	int const FlockPartIncrement = FlockPart;
+	int32 const NumMembers = FlockMembers.Num();
+	FTransform const ComponentTransform = StaticMeshInstanceComponent->GetComponentTransform();
 
-	for (int i = 0; i < MaxUseThreads; i++)
+	ActiveSlots.SetNumUninitialized(NumMembers);
+	RenderedLocations.SetNumUninitialized(NumMembers);
+	InstanceStates.Init(FlockInstanceState::Visible, NumMembers);
+	InstanceDirty.Init(false, NumMembers);
+	AnimationPhases.SetNumUninitialized(NumMembers);
+	InstanceTransforms.SetNumUninitialized(NumMembers);
+	FreeSlots.Reset();
+	NumActiveMembers = 0;
+
+	for (int32 Slot = 0; Slot < NumMembers; ++Slot)
 	{
-		for ( ; FlockID < FlockPart; FlockID++)
+		// Slot is instance index.
+		FlockMembers.InstanceIndices[Slot] = Slot;
+
+		bool const bActive = FlockMembers.HasFlag(Slot, FlockMemberFlags::Active);
+		ActiveSlots[Slot] = bActive;
+		if (bActive)
 		{
-			TempFlockData.Add(FlockMemberDataArr[FlockID]);
+			++NumActiveMembers;
 		}
+		else
+		{
+			FreeSlots.Add(Slot);
+		}
+
+		FTransform const WorldTransform = bActive ? FlockMembers.GetTransform(Slot) : FTransform(FQuat::Identity, FlockMembers.GetLocation(Slot), FVector::ZeroVector);
+		RenderedLocations[Slot] = WorldTransform.GetLocation();
+		AnimationPhases[Slot] = SpawnRandom.FRand();
+		InstanceTransforms[Slot] = WorldTransform.GetRelativeTransform(ComponentTransform);
+	}
+
+	// One call for all instances instead of one per member.
+	StaticMeshInstanceComponent->AddInstances(InstanceTransforms, false);
+	NumFlock = NumMembers;
+
+	return true;
+}
+
+void AFlockSystemActor::StartFlockRecording(int32 KeyframeInterval)
+{
+	if (!Simulation) return;
+
+	// Recorder is set only between steps.
+	Simulation->EnsureCompletion();
+	Recorder = MakeShared<FlockReplayRecorder, ESPMode::ThreadSafe>(GetQuantizationBounds(), KeyframeInterval);
+	Simulation->SetRecorder(Recorder);
+}
+
+bool AFlockSystemActor::StopFlockRecording(const FString& FileName)
+{
+	if (!Simulation || !Recorder.IsValid()) return false;
+
+	// Queued step has not started, it runs without recorder.
+	Simulation->EnsureCompletion();
+	Simulation->SetRecorder(nullptr);
+
+	TSharedPtr<FlockReplayRecorder, ESPMode::ThreadSafe> const FinishedRecorder = Recorder;
+	Recorder.Reset();
+
+	FinishedRecorder->LogSummary(NumActiveMembers);
+
+	return FinishedRecorder->Save(GetSnapshotPath(FileName));
+}
+
+bool AFlockSystemActor::StartFlockReplay(const FString& FileName)
+{
+	TUniquePtr<FlockReplayPlayer> NewPlayer = MakeUnique<FlockReplayPlayer>();
+	if (!NewPlayer->Load(GetSnapshotPath(FileName))) return false;
+
+	ReplayPlayer = MoveTemp(NewPlayer);
+	ReplayResult.Members.Reset();
+	ReplayPlayer->DecodeNextFrame(ReplayResult.Members);
+	ReplayResult.PreviousPositions = ReplayResult.Members.Positions;
+	ReplayResult.PreviousOrientations = ReplayResult.Members.Orientations;
+	PendingStepTime = 0.f;
+	return true;
+}
 
-		NewFlockData.AddData(i, TempFlockData);
-		AllFlockMembersArrays.Add(NewFlockData);
-		TempFlockData.Empty();
+void AFlockSystemActor::StopFlockReplay()
+{
+	ReplayPlayer.Reset();
+	PendingStepTime = 0.f;
+}
+
+const FlockStepResult& AFlockSystemActor::AdvanceReplay(float DeltaTime)
+{
+	PendingStepTime += DeltaTime;
 
-		FlockPart += FlockPartIncrement;
+	// At most one loop of the recording per frame.
+	for (int32 Frame = 0; Frame < ReplayPlayer->GetNumFrames() && PendingStepTime >= ReplayPlayer->GetNextFrameDeltaTime(); ++Frame)
+	{
+		PendingStepTime -= ReplayPlayer->GetNextFrameDeltaTime();
+		ReplayResult.PreviousPositions = ReplayResult.Members.Positions;
+		ReplayResult.PreviousOrientations = ReplayResult.Members.Orientations;
+		ReplayPlayer->DecodeNextFrame(ReplayResult.Members);
 	}
+	PendingStepTime = FMath::Min(PendingStepTime, ReplayPlayer->GetNextFrameDeltaTime());
+
+	return ReplayResult;
+}
 
-	// Adding the remainder of the division.
-	if (FlockID < FlockMemberDataArr.Num() - 1 && FlockID == (FlockPartIncrement * MaxUseThreads))
+FBox AFlockSystemActor::GetQuantizationBounds() const
+{
+	FVector Extent = BoxComponent->GetScaledBoxExtent();
+	if (!FlockParameters.bUseAquarium)
 	{
-		for ( ; FlockID < FlockMemberDataArr.Num(); FlockID++)
-		{
-			AllFlockMembersArrays[MaxUseThreads - 1].FlockMembersArr.Add(FlockMemberDataArr[FlockID]);
-		}
+		Extent = Extent.ComponentMax(FVector(FlockParameters.FlockWanderInRandomRadius));
 	}
+	return FBox::BuildAABB(BoxComponent->GetComponentLocation(), Extent * 2.f);
 }
 
-void AFlockSystemActor::AddFlockMemberWorldSpace(const FTransform& WorldTransform)
+void AFlockSystemActor::OnConstruction(const FTransform& Transform)
 {
-	StaticMeshInstanceComponent->AddInstanceWorldSpace(WorldTransform);
+	Super::OnConstruction(Transform);
 
-	FlockMemberData FlockMember;
-	FlockMember.InstanceIndex = NumFlock;
-	FlockMember.Transform = WorldTransform;
-	//   flockMember_.Velocity = flockMember_.WanderPosition - flockMember_.Transform.GetLocation();
-	if (NumFlock == 0)
+	// Not replicated flock costs no bandwidth. Replicated one covers a large area, clients need it everywhere.
+	bReplicates = bReplicateFlock;
+	bAlwaysRelevant = bReplicateFlock;
+}
+
+void AFlockSystemActor::GetLifetimeReplicatedProps(TArray<FLifetimeProperty>& OutLifetimeProps) const
+{
+	Super::GetLifetimeReplicatedProps(OutLifetimeProps);
+
+	DOREPLIFETIME(AFlockSystemActor, ReplicatedSeed);
+	DOREPLIFETIME(AFlockSystemActor, LeaderWanders);
+	DOREPLIFETIME(AFlockSystemActor, ReplicatedDangerActors);
+}
+
+bool AFlockSystemActor::IsReplicatedClient() const
+{
+	return bReplicateFlock && !HasAuthority();
+}
+
+void AFlockSystemActor::OnRep_ReplicatedSeed()
+{
+	// Seed arrived after BeginPlay.
+	if (HasActorBegunPlay() && !Simulation)
 	{
-		FlockMember.bIsFlockLeader = true;
+		SpawnFlock();
+	}
+}
+
+void AFlockSystemActor::OnRep_LeaderWanders()
+{
+	if (!Simulation) return;
+
+	for (FlockNetLeaderWander const& LeaderWander : LeaderWanders)
+	{
+		FlockMemberCommand& Command = PendingMemberCommands.AddDefaulted_GetRef();
+		Command.Slot = LeaderWander.Slot;
+		Command.Type = FlockMemberCommandType::Wander;
+		Command.Location = LeaderWander.WanderTarget;
 	}
-	FlockMemberDataArr.Add(FlockMember);
-	NumFlock++;
 }
 
-TArray<int32> FlockThread::GetNearbyFlockMates(int32 FlockMember)
+void AFlockSystemActor::UpdateFlockReplication()
 {
-	TArray<int32> Mates;
-	if (FlockMember > FlockThreadMembersArr.Num()) return Mates;
-	if (FlockMember < 0) return Mates;
+	if (!Simulation) return;
+
+	// State shown by the last Tick, read buffer is owned by game thread.
+	FlockStepResult const& ShownStep = Simulation->StepBuffers.GetReadBuffer();
+	FlockMemberStore const& Members = ShownStep.Members;
+	int32 const NumMembers = Members.Num();
+	uint32 PayloadBytes = 0;
+
+	if (ReplicatedDangerActors != DangerActors)
+	{
+		ReplicatedDangerActors = DangerActors;
+		PayloadBytes += DangerActors.Num() * sizeof(uint32);
+	}
+
+	// Clients pick the same wander targets only until they diverge. Property is sent only when it changed.
+	TArray<FlockNetLeaderWander> NewLeaderWanders;
+	for (int32 FlockMemberID = 0; FlockMemberID < NumMembers; ++FlockMemberID)
+	{
+		if (Members.HasFlag(FlockMemberID, FlockMemberFlags::Leader) && Members.HasFlag(FlockMemberID, FlockMemberFlags::Active))
+		{
+			FlockNetLeaderWander& LeaderWander = NewLeaderWanders.AddDefaulted_GetRef();
+			LeaderWander.Slot = FlockMemberID;
+			LeaderWander.WanderTarget = FVector(Members.WanderTargets[FlockMemberID]);
+		}
+	}
+	if (NewLeaderWanders != LeaderWanders)
+	{
+		LeaderWanders = MoveTemp(NewLeaderWanders);
+		PayloadBytes += LeaderWanders.Num() * (sizeof(int32) + sizeof(FVector));
+	}
 
-	for (int32 i = 0; i < FlockThreadMembersArr.Num(); i++)
+	// Next range of slots, every slot is corrected once in NumMembers / NetCorrectionsPerUpdate updates.
+	int32 const NumCorrections = FMath::Min(NetCorrectionsPerUpdate, NumMembers);
+	if (NumCorrections > 0)
 	{
-		if (i != FlockMember)
+		if (NetCorrectionCursor >= NumMembers)
 		{
-			FVector diff = FlockThreadMembersArr[i].Transform.GetLocation() - FlockThreadMembersArr[FlockMember].Transform.GetLocation();
-			if (FMath::Abs(diff.Size()) < FlockParametersTHR.FlockMateAwarenessRadius)
+			NetCorrectionCursor = 0;
+		}
+		int32 const LastSlot = FMath::Min(NetCorrectionCursor + NumCorrections, NumMembers);
+
+		FBox const Bounds = GetQuantizationBounds();
+		FlockNetCorrections Corrections;
+		Corrections.FirstSlot = NetCorrectionCursor;
+		Corrections.ServerStep = ShownStep.StepNumber;
+		Corrections.BoundsMin = Bounds.Min;
+		Corrections.BoundsSize = Bounds.GetSize().ComponentMax(FVector(1.f));
+		Corrections.MaxSpeed = FMath::Max(FlockParameters.FlockMaxSpeed * FlockParameters.EscapeMaxSpeedMultiply, 1.f);
+		Corrections.Locations.SetNumUninitialized((LastSlot - NetCorrectionCursor) * 3);
+		Corrections.Velocities.SetNumUninitialized((LastSlot - NetCorrectionCursor) * 3);
+		Corrections.ActiveMask.SetNumZeroed(FMath::DivideAndRoundUp(LastSlot - NetCorrectionCursor, 8));
+
+		FVector const LocationScale = FVector(65535.f) / Corrections.BoundsSize;
+		float const VelocityScale = 127.f / Corrections.MaxSpeed;
+		for (int32 Slot = NetCorrectionCursor; Slot < LastSlot; ++Slot)
+		{
+			int32 const Index = (Slot - NetCorrectionCursor) * 3;
+			FVector const Local = (Members.GetLocation(Slot) - Corrections.BoundsMin) * LocationScale;
+			FVector const Velocity = Members.GetVelocity(Slot) * VelocityScale;
+			for (int32 Axis = 0; Axis < 3; ++Axis)
+			{
+				Corrections.Locations[Index + Axis] = uint16(FMath::Clamp(FMath::RoundToInt(Local[Axis]), 0, 65535));
+				Corrections.Velocities[Index + Axis] = int8(FMath::Clamp(FMath::RoundToInt(Velocity[Axis]), -127, 127));
+			}
+
+			// Slots of this frame, also spawns and removes the step has not applied yet. Those are sent reliably too.
+			if (ActiveSlots.IsValidIndex(Slot) && ActiveSlots[Slot])
 			{
-				Mates.Add(i);
+				int32 const MaskBit = Slot - NetCorrectionCursor;
+				Corrections.ActiveMask[MaskBit / 8] |= uint8(1 << (MaskBit % 8));
 			}
 		}
+		NetCorrectionCursor = LastSlot;
+
+		MulticastFlockCorrections(Corrections);
+		PayloadBytes += sizeof(int32) * 2 + sizeof(FVector) * 2 + sizeof(float) + Corrections.Locations.Num() * sizeof(uint16) + Corrections.Velocities.Num()
+			+ Corrections.ActiveMask.Num();
+	}
+
+	INC_DWORD_STAT_BY(STAT_FlockNetPayloadBytes, PayloadBytes);
+}
+
+void AFlockSystemActor::MulticastFlockCorrections_Implementation(const FlockNetCorrections& Corrections)
+{
+	// Multicast runs on server too.
+	if (HasAuthority() || !Simulation) return;
+
+	int32 const NumCorrections = FMath::Min(FMath::Min(Corrections.Locations.Num(), Corrections.Velocities.Num()) / 3, Corrections.ActiveMask.Num() * 8);
+	FVector const LocationScale = Corrections.BoundsSize / 65535.f;
+	float const VelocityScale = Corrections.MaxSpeed / 127.f;
+
+	// Server substep now is about ServerStep plus half the round trip. Offset is kept while it stays close, so ping jitter does not move members.
+	float const StepRate = FMath::Max(1.f, FlockParameters.FixedStepRate);
+	APlayerController const* PlayerController = GetWorld()->GetFirstPlayerController();
+	float const RoundTripSeconds = PlayerController && PlayerController->PlayerState ? PlayerController->PlayerState->ExactPing * 0.001f : 0.f;
+	int32 const ClientStep = Simulation->StepBuffers.GetReadBuffer().StepNumber;
+	int32 const NewStepOffset = Corrections.ServerStep + FMath::RoundToInt(RoundTripSeconds * 0.5f * StepRate) - ClientStep;
+	if (!bNetStepSynced || FMath::Abs(NewStepOffset - NetStepOffset) > FMath::RoundToInt(StepRate))
+	{
+		NetStepOffset = NewStepOffset;
+		bNetStepSynced = true;
+	}
+
+	// Server state of an older substep, extrapolated to the client substep it is applied in.
+	for (int32 i = 0; i < NumCorrections; ++i)
+	{
+		int32 const Index = i * 3;
+		int32 const Slot = Corrections.FirstSlot + i;
+		if (!ActiveSlots.IsValidIndex(Slot)) break;
+
+		FVector const Location = Corrections.BoundsMin + FVector(Corrections.Locations[Index], Corrections.Locations[Index + 1], Corrections.Locations[Index + 2]) * LocationScale;
+		FVector const Velocity = FVector(Corrections.Velocities[Index], Corrections.Velocities[Index + 1], Corrections.Velocities[Index + 2]) * VelocityScale;
+		bool const bServerActive = (Corrections.ActiveMask[i / 8] & (1 << (i % 8))) != 0;
+
+		// Spawn or remove missed by this client, e.g. sent before it joined. Scale and random stream of the server member
+		// are not replicated, spawn uses mean scale and a seed of the slot. Queued before the correction, so it applies to the spawn.
+		if (bServerActive != bool(ActiveSlots[Slot]))
+		{
+			FlockMemberCommand SlotCommand;
+			SlotCommand.Slot = Slot;
+			SlotCommand.Type = bServerActive ? FlockMemberCommandType::Spawn : FlockMemberCommandType::Remove;
+			SlotCommand.Transform = FTransform(Velocity.IsNearlyZero() ? FQuat::Identity : Velocity.ToOrientationQuat(), Location, FVector((MinMeshScale + MaxMeshScale) * 0.5f));
+			SlotCommand.RandomSeed = int32(HashCombine(GetTypeHash(ReplicatedSeed), GetTypeHash(Slot)));
+			QueueMemberCommand(SlotCommand);
+		}
+		if (!bServerActive) continue;
+
+		FlockMemberCommand& Command = PendingMemberCommands.AddDefaulted_GetRef();
+		Command.Slot = Slot;
+		Command.Type = FlockMemberCommandType::Correct;
+		Command.StepNumber = Corrections.ServerStep - NetStepOffset;
+		Command.Location = Location;
+		Command.Velocity = Velocity;
 	}
+}
 
-	return Mates;
+void AFlockSystemActor::MulticastMemberCommands_Implementation(const TArray<FlockNetMemberCommand>& Commands)
+{
+	if (HasAuthority() || !Simulation) return;
+
+	for (FlockNetMemberCommand const& NetCommand : Commands)
+	{
+		FlockMemberCommand Command;
+		Command.Slot = NetCommand.Slot;
+		Command.Type = NetCommand.bSpawn ? FlockMemberCommandType::Spawn : FlockMemberCommandType::Remove;
+		Command.Transform = FTransform(NetCommand.Rotation, NetCommand.Location, FVector(NetCommand.Scale));
+		Command.RandomSeed = NetCommand.RandomSeed;
+		QueueMemberCommand(Command);
+	}
 }
@@ -0,0 +1,261 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#include "FlockSystemActor.h"
+#include "FlockTestWorld.h"
+#include "Components/StaticMeshComponent.h"
+#include "Engine/StaticMesh.h"
+#include "Engine/StaticMeshActor.h"
+#include "HAL/FileManager.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformMemory.h"
+#include "HAL/PlatformTime.h"
+#include "Misc/AutomationTest.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+DEFINE_LOG_CATEGORY_STATIC(LogFlockBenchmark, Log, All);
+
+static TAutoConsoleVariable<int32> CVarFlockBenchmarkSteps(
+	TEXT("Flock.BenchmarkSteps"),
+	300,
+	TEXT("Measured flock steps of every AdvancedFlockSystem.Benchmark scenario."));
+
+// Headless flock benchmark, e.g. with -nullrhi -ExecCmds="Automation RunTests AdvancedFlockSystem.Benchmark".
+// Every scenario is one test in its own game world. It runs a fixed number of steps and adds one line to Saved/Profiling/Flock/FlockBenchmark.csv.
+namespace FlockBenchmark
+{
+	struct Scenario
+	{
+		int32 NumMembers = 1000;
+		// Flock.StepChunkSize, members per ParallelFor chunk. Number of chunks is the parallelism of the step.
+		int32 StepChunkSize = 64;
+		bool bAquarium = false;
+		bool bAvoidance = false;
+		bool bDanger = false;
+	};
+
+	// Value at Percentile in [0, 1] of sorted Values.
+	float GetPercentile(const TArray<float>& SortedValues, float Percentile)
+	{
+		if (SortedValues.Num() == 0) return 0.f;
+
+		int32 const Index = FMath::Clamp(FMath::CeilToInt(Percentile * SortedValues.Num()) - 1, 0, SortedValues.Num() - 1);
+		return SortedValues[Index];
+	}
+
+	float GetMean(const TArray<float>& Values)
+	{
+		if (Values.Num() == 0) return 0.f;
+
+		double Sum = 0.0;
+		for (float Value : Values)
+		{
+			Sum += Value;
+		}
+		return float(Sum / Values.Num());
+	}
+
+	// Mean, p50 and p99 in milliseconds.
+	FString GetTimesCSV(TArray<float>& Times)
+	{
+		Times.Sort();
+		return FString::Printf(TEXT("%.4f,%.4f,%.4f"), GetMean(Times) * 1000.f, GetPercentile(Times, 0.5f) * 1000.f, GetPercentile(Times, 0.99f) * 1000.f);
+	}
+
+	AStaticMeshActor* SpawnMeshActor(UWorld* World, const FTransform& Transform, UStaticMesh* Mesh, EComponentMobility::Type Mobility)
+	{
+		AStaticMeshActor* MeshActor = World->SpawnActor<AStaticMeshActor>(AStaticMeshActor::StaticClass(), Transform);
+		if (MeshActor)
+		{
+			// Mesh is set while movable, static components do not take a new mesh at runtime.
+			MeshActor->GetStaticMeshComponent()->SetMobility(EComponentMobility::Movable);
+			MeshActor->GetStaticMeshComponent()->SetStaticMesh(Mesh);
+			MeshActor->GetStaticMeshComponent()->SetMobility(Mobility);
+		}
+		return MeshActor;
+	}
+
+	float ToMB(double Bytes)
+	{
+		return float(Bytes / (1024.0 * 1024.0));
+	}
+
+	// CSV line of the scenario, empty if the flock actor was not spawned.
+	FString RunScenario(UWorld* World, const Scenario& Setup, int32 NumSteps)
+	{
+		FVector const Origin(0.f, 0.f, 10000.f);
+		UStaticMesh* CubeMesh = LoadObject<UStaticMesh>(nullptr, TEXT("/Engine/BasicShapes/Cube.Cube"));
+
+		// Chunk size is read when the simulation is created and at every step start.
+		IConsoleVariable* ChunkSizeVariable = IConsoleManager::Get().FindConsoleVariable(TEXT("Flock.StepChunkSize"));
+		int32 const PreviousChunkSize = ChunkSizeVariable ? ChunkSizeVariable->GetInt() : 0;
+		if (ChunkSizeVariable)
+		{
+			ChunkSizeVariable->Set(Setup.StepChunkSize, ECVF_SetByCode);
+		}
+
+		uint64 const UsedPhysicalBefore = FPlatformMemory::GetStats().UsedPhysical;
+
+		AFlockSystemActor* FlockActor = World->SpawnActorDeferred<AFlockSystemActor>(AFlockSystemActor::StaticClass(), FTransform(Origin));
+		if (!FlockActor)
+		{
+			if (ChunkSizeVariable)
+			{
+				ChunkSizeVariable->Set(PreviousChunkSize, ECVF_SetByCode);
+			}
+			return FString();
+		}
+
+		FlockActor->StaticMesh = CubeMesh;
+		FlockActor->FlockMateInstances = Setup.NumMembers;
+		// Only scenario obstacles and danger actors, no timer.
+		FlockActor->FlockParameters.bAutoAddComponentsInArray = false;
+		FlockActor->FlockParameters.bReactOnPawn = false;
+		FlockActor->FlockParameters.bUseAquarium = Setup.bAquarium;
+		// One fixed step per Tick. Every member steps every step and is uploaded, no player views in headless run anyway.
+		FlockActor->FlockParameters.bUseFixedTimeStep = true;
+		FlockActor->FlockParameters.bUseSimulationLOD = false;
+		FlockActor->bUseViewCulling = false;
+		// Own step task, so WaitForFlockStep after Tick waits for this flock's step.
+		FlockActor->bSimulateInWorldSubsystem = false;
+
+		if (Setup.bAvoidance)
+		{
+			// Static, so it is baked into the avoidance field. Moving obstacles are avoided by their bounds instead.
+			AStaticMeshActor* Obstacle = SpawnMeshActor(World, FTransform(FQuat::Identity, Origin, FVector(5.f)), CubeMesh, EComponentMobility::Static);
+			if (Obstacle)
+			{
+				FlockActor->AvoidanceActorRootArr.Add(Obstacle);
+			}
+		}
+
+		if (Setup.bDanger)
+		{
+			AStaticMeshActor* DangerActor = SpawnMeshActor(World, FTransform(Origin + FVector(500.f, 0.f, 0.f)), nullptr, EComponentMobility::Movable);
+			if (DangerActor)
+			{
+				FlockActor->DangerActors.Add(DangerActor);
+			}
+		}
+
+		FlockActor->FinishSpawning(FTransform(Origin));
+		// Every measured step samples the baked field.
+		FlockActor->WaitForAvoidanceBake();
+
+		float const DeltaTime = 1.f / FMath::Max(1.f, FlockActor->FlockParameters.FixedStepRate);
+
+		TArray<float> StepTimes;
+		TArray<float> TickTimes;
+		StepTimes.Reserve(NumSteps);
+		TickTimes.Reserve(NumSteps);
+		// Peak of process memory, sampled while a step runs and after it.
+		uint64 PeakUsedPhysical = FPlatformMemory::GetStats().UsedPhysical;
+
+		// Warm up, the first Tick starts the first step and has no step result to show.
+		FlockActor->Tick(DeltaTime);
+		FlockActor->WaitForFlockStep();
+
+		for (int32 StepIndex = 0; StepIndex < NumSteps; ++StepIndex)
+		{
+			double const TickStartTime = FPlatformTime::Seconds();
+			FlockActor->Tick(DeltaTime);
+			TickTimes.Add(float(FPlatformTime::Seconds() - TickStartTime));
+			PeakUsedPhysical = FMath::Max(PeakUsedPhysical, FPlatformMemory::GetStats().UsedPhysical);
+
+			// Tick shows the previous step, started by the previous Tick.
+			StepTimes.Add(FlockActor->LastStepTime);
+
+			// Not overlapped with next Tick, so tick time does not include waiting for workers.
+			FlockActor->WaitForFlockStep();
+			PeakUsedPhysical = FMath::Max(PeakUsedPhysical, FPlatformMemory::GetStats().UsedPhysical);
+		}
+
+		// Memory of this scenario only: peak and end of process memory relative to before spawn, and allocations owned by the flock.
+		int64 const PeakUsedPhysicalDelta = int64(PeakUsedPhysical) - int64(UsedPhysicalBefore);
+		int64 const UsedPhysicalDelta = int64(FPlatformMemory::GetStats().UsedPhysical) - int64(UsedPhysicalBefore);
+		SIZE_T const FlockAllocatedSize = FlockActor->GetFlockAllocatedSize();
+
+		if (ChunkSizeVariable)
+		{
+			ChunkSizeVariable->Set(PreviousChunkSize, ECVF_SetByCode);
+		}
+
+		return FString::Printf(TEXT("%d,%d,%d,%d,%d,%d,%s,%s,%.2f,%.2f,%.2f"), Setup.NumMembers, Setup.StepChunkSize, Setup.bAquarium, Setup.bAvoidance, Setup.bDanger, NumSteps,
+							   *GetTimesCSV(StepTimes), *GetTimesCSV(TickTimes), ToMB(double(PeakUsedPhysicalDelta)), ToMB(double(UsedPhysicalDelta)), ToMB(double(FlockAllocatedSize)));
+	}
+
+	// Append Line to the benchmark CSV, with header for a new file.
+	void WriteCSVLine(const FString& Line)
+	{
+		FString const FileName = FPaths::ProfilingDir() / TEXT("Flock") / TEXT("FlockBenchmark.csv");
+		FString Text;
+		if (!IFileManager::Get().FileExists(*FileName))
+		{
+			Text = TEXT("Members,StepChunkSize,Aquarium,Avoidance,Danger,Steps,StepMeanMs,StepP50Ms,StepP99Ms,TickMeanMs,TickP50Ms,TickP99Ms,PeakUsedPhysicalDeltaMB,UsedPhysicalDeltaMB,FlockAllocatedMB") LINE_TERMINATOR;
+		}
+		Text += Line + LINE_TERMINATOR;
+
+		if (!FFileHelper::SaveStringToFile(Text, *FileName, FFileHelper::EEncodingOptions::AutoDetect, &IFileManager::Get(), FILEWRITE_Append))
+		{
+			UE_LOG(LogFlockBenchmark, Error, TEXT("Failed to write flock benchmark to %s"), *FileName);
+		}
+	}
+}
+
+IMPLEMENT_COMPLEX_AUTOMATION_TEST(FlockBenchmarkTest, "AdvancedFlockSystem.Benchmark",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::PerfFilter)
+
+void FlockBenchmarkTest::GetTests(TArray<FString>& OutBeautifiedNames, TArray<FString>& OutTestCommands) const
+{
+	static const int32 MemberCounts[] = { 1000, 10000, 50000 };
+	static const int32 ChunkSizes[] = { 16, 64, 256 };
+
+	for (int32 NumMembers : MemberCounts)
+	{
+		for (int32 ChunkSize : ChunkSizes)
+		{
+			// Aquarium, avoidance and danger actors on or off.
+			for (int32 Features = 0; Features < 8; ++Features)
+			{
+				FString FeatureName;
+				FeatureName += (Features & 1) ? TEXT("Aquarium") : TEXT("");
+				FeatureName += (Features & 2) ? TEXT("Avoidance") : TEXT("");
+				FeatureName += (Features & 4) ? TEXT("Danger") : TEXT("");
+
+				OutBeautifiedNames.Add(FString::Printf(TEXT("Members%d.Chunk%d.%s"), NumMembers, ChunkSize, FeatureName.IsEmpty() ? TEXT("Plain") : *FeatureName));
+				OutTestCommands.Add(FString::Printf(TEXT("%d %d %d"), NumMembers, ChunkSize, Features));
+			}
+		}
+	}
+}
+
+bool FlockBenchmarkTest::RunTest(const FString& Parameters)
+{
+	TArray<FString> Values;
+	Parameters.ParseIntoArrayWS(Values);
+	if (Values.Num() != 3)
+	{
+		AddError(FString::Printf(TEXT("Bad scenario parameters '%s'."), *Parameters));
+		return false;
+	}
+
+	FlockBenchmark::Scenario Setup;
+	Setup.NumMembers = FMath::Max(1, FCString::Atoi(*Values[0]));
+	Setup.StepChunkSize = FMath::Max(1, FCString::Atoi(*Values[1]));
+	int32 const Features = FCString::Atoi(*Values[2]);
+	Setup.bAquarium = (Features & 1) != 0;
+	Setup.bAvoidance = (Features & 2) != 0;
+	Setup.bDanger = (Features & 4) != 0;
+
+	FlockTestWorld TestWorld;
+	FString const Line = FlockBenchmark::RunScenario(TestWorld.Get(), Setup, FMath::Max(1, CVarFlockBenchmarkSteps.GetValueOnGameThread()));
+	if (!TestTrue(TEXT("Flock actor spawned"), !Line.IsEmpty())) return false;
+
+	UE_LOG(LogFlockBenchmark, Display, TEXT("%s"), *Line);
+	FlockBenchmark::WriteCSVLine(Line);
+	return true;
+}
+
+#endif
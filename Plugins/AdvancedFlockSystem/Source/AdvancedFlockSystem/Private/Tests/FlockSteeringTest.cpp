@@ -0,0 +1,63 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#include "FlockSteering.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FlockSteeringTest, "AdvancedFlockSystem.Steering.VectorizedMatchesScalar",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+// AccumulateMates and its scalar fallback give the same sums within tolerance: random mates, mate counts with a remainder of 4
+// and mates at the member location, which separation skips.
+bool FlockSteeringTest::RunTest(const FString& Parameters)
+{
+	FRandomStream Random(1234);
+
+	static constexpr int32 NumPositions = 256;
+	TArray<FVector4> Positions;
+	TArray<FVector4> Velocities;
+	Positions.SetNumUninitialized(NumPositions);
+	Velocities.SetNumUninitialized(NumPositions);
+
+	FVector const Location(100.f, -50.f, 300.f);
+	for (int32 i = 0; i < NumPositions; ++i)
+	{
+		// Every 5th mate is at the member location.
+		FVector const Position = i % 5 == 0 ? Location : Location + Random.VRand() * Random.FRandRange(1.f, 400.f);
+		Positions[i] = FVector4(Position, Random.FRandRange(0.5f, 2.f));
+		Velocities[i] = FVector4(Random.VRand() * Random.FRandRange(0.f, 600.f), 0.f);
+	}
+
+	int32 const MateCounts[] = { 0, 1, 2, 3, 4, 5, 7, 8, 13, 31, 64, 101 };
+	for (int32 NumMates : MateCounts)
+	{
+		// Random mates in random order, like grid queries return them.
+		TArray<int32> Mates;
+		for (int32 i = 0; i < NumMates; ++i)
+		{
+			Mates.Add(Random.RandRange(0, NumPositions - 1));
+		}
+
+		FlockMatesSums Vectorized;
+		FlockMatesSums Scalar;
+		FlockSteering::AccumulateMates(Positions.GetData(), Velocities.GetData(), Mates.GetData(), NumMates, Location, Vectorized);
+		FlockSteering::AccumulateMatesScalar(Positions.GetData(), Velocities.GetData(), Mates.GetData(), NumMates, Location, Scalar);
+
+		// Sums are added in another order, tolerance grows with their size.
+		auto IsNear = [](const FVector& A, const FVector& B)
+		{
+			return A.Equals(B, 1.e-3f * FMath::Max(1.f, B.GetAbsMax()));
+		};
+
+		TestEqual(FString::Printf(TEXT("Num of %d mates"), NumMates), Vectorized.Num, Scalar.Num);
+		TestTrue(FString::Printf(TEXT("Position sum of %d mates"), NumMates), IsNear(Vectorized.Position, Scalar.Position));
+		TestTrue(FString::Printf(TEXT("Velocity sum of %d mates"), NumMates), IsNear(Vectorized.Velocity, Scalar.Velocity));
+		TestTrue(FString::Printf(TEXT("Separation sum of %d mates"), NumMates), IsNear(Vectorized.Separation, Scalar.Separation));
+		TestFalse(FString::Printf(TEXT("Separation of %d mates is finite"), NumMates), Vectorized.Separation.ContainsNaN());
+	}
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,44 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Engine/Engine.h"
+#include "Engine/World.h"
+#include "EngineUtils.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+// Own game world of one automation test, begun play. Destroyed with all its actors at the end of scope.
+class FlockTestWorld
+{
+public:
+
+	FlockTestWorld()
+	{
+		World = UWorld::CreateWorld(EWorldType::Game, false);
+		FWorldContext& WorldContext = GEngine->CreateNewWorldContext(EWorldType::Game);
+		WorldContext.SetCurrentWorld(World);
+
+		World->InitializeActorsForPlay(FURL());
+		World->BeginPlay();
+	}
+
+	~FlockTestWorld()
+	{
+		for (TActorIterator<AActor> It(World); It; ++It)
+		{
+			It->Destroy();
+		}
+		GEngine->DestroyWorldContext(World);
+		World->DestroyWorld(false);
+	}
+
+	UWorld* Get() const { return World; }
+
+private:
+
+	UWorld* World = nullptr;
+};
+
+#endif
@@ -0,0 +1,166 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#include "FlockSystemActor.h"
+#include "FlockTestWorld.h"
+#include "Components/InstancedStaticMeshComponent.h"
+#include "Engine/StaticMesh.h"
+#include "HAL/MemoryBase.h"
+#include "Misc/AutomationTest.h"
+
+// Counter replaces GMalloc, platforms with a fixed GMalloc class call their allocator without it.
+#if WITH_DEV_AUTOMATION_TESTS && !PLATFORM_USES_FIXED_GMalloc_CLASS
+
+// Counts allocations of the game thread while counting is on, all calls go to the wrapped allocator.
+class FlockAllocationCounter : public FMalloc
+{
+public:
+
+	explicit FlockAllocationCounter(FMalloc* InInner)
+		: Inner(InInner)
+	{
+	}
+
+	virtual void* Malloc(SIZE_T Count, uint32 Alignment) override
+	{
+		CountAllocation();
+		return Inner->Malloc(Count, Alignment);
+	}
+
+	virtual void* TryMalloc(SIZE_T Count, uint32 Alignment) override
+	{
+		CountAllocation();
+		return Inner->TryMalloc(Count, Alignment);
+	}
+
+	virtual void* Realloc(void* Original, SIZE_T Count, uint32 Alignment) override
+	{
+		if (Count > 0)
+		{
+			CountAllocation();
+		}
+		return Inner->Realloc(Original, Count, Alignment);
+	}
+
+	virtual void* TryRealloc(void* Original, SIZE_T Count, uint32 Alignment) override
+	{
+		if (Count > 0)
+		{
+			CountAllocation();
+		}
+		return Inner->TryRealloc(Original, Count, Alignment);
+	}
+
+	virtual void Free(void* Original) override { Inner->Free(Original); }
+	virtual bool GetAllocationSize(void* Original, SIZE_T& SizeOut) override { return Inner->GetAllocationSize(Original, SizeOut); }
+	virtual SIZE_T QuantizeSize(SIZE_T Count, uint32 Alignment) override { return Inner->QuantizeSize(Count, Alignment); }
+	virtual void Trim(bool bTrimThreadCaches) override { Inner->Trim(bTrimThreadCaches); }
+	virtual void SetupTLSCachesOnCurrentThread() override { Inner->SetupTLSCachesOnCurrentThread(); }
+	virtual void ClearAndDisableTLSCachesOnCurrentThread() override { Inner->ClearAndDisableTLSCachesOnCurrentThread(); }
+	virtual void InitializeStatsMetadata() override { Inner->InitializeStatsMetadata(); }
+	virtual void UpdateStats() override { Inner->UpdateStats(); }
+	virtual void GetAllocatorStats(FGenericMemoryStats& OutStats) override { Inner->GetAllocatorStats(OutStats); }
+	virtual void DumpAllocatorStats(FOutputDevice& Ar) override { Inner->DumpAllocatorStats(Ar); }
+	virtual bool IsInternallyThreadSafe() const override { return Inner->IsInternallyThreadSafe(); }
+	virtual bool ValidateHeap() override { return Inner->ValidateHeap(); }
+	virtual const TCHAR* GetDescriptiveName() override { return TEXT("FlockAllocationCounter"); }
+
+	bool bCounting = false;
+	int32 NumAllocations = 0;
+
+private:
+
+	void CountAllocation()
+	{
+		if (bCounting && IsInGameThread())
+		{
+			++NumAllocations;
+		}
+	}
+
+	FMalloc* Inner;
+};
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FlockTickAllocationTest, "AdvancedFlockSystem.Tick.NoAllocations",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+// Steady state Tick of a flock allocates nothing on the game thread: interpolation, view culling with visible, culled and hidden
+// instances, custom data, step start and instance upload. Step itself runs on workers and is not counted.
+// Test world has no local player, view is an extra frustum.
+bool FlockTickAllocationTest::RunTest(const FString& Parameters)
+{
+	FlockTestWorld TestWorld;
+	UWorld* World = TestWorld.Get();
+
+	AFlockSystemActor* FlockActor = World->SpawnActorDeferred<AFlockSystemActor>(AFlockSystemActor::StaticClass(), FTransform(FVector(0.f, 0.f, 10000.f)));
+	if (!TestNotNull(TEXT("Flock actor"), FlockActor)) return false;
+
+	FlockActor->StaticMesh = LoadObject<UStaticMesh>(nullptr, TEXT("/Engine/BasicShapes/Cube.Cube"));
+	FlockActor->FlockMateInstances = 2000;
+	FlockActor->FlockParameters.bAutoAddComponentsInArray = false;
+	FlockActor->FlockParameters.bReactOnPawn = false;
+	FlockActor->FlockParameters.bUseFixedTimeStep = true;
+	FlockActor->bUseViewCulling = true;
+	FlockActor->ViewCullingPadding = 0.f;
+	// Own step task, so WaitForFlockStep after Tick waits for this flock's step.
+	FlockActor->bSimulateInWorldSubsystem = false;
+	FlockActor->NumCustomDataFloats = 2;
+	FlockActor->FinishSpawning(FTransform(FVector(0.f, 0.f, 10000.f)));
+
+	float const DeltaTime = 1.f / FMath::Max(1.f, FlockActor->FlockParameters.FixedStepRate);
+
+	// Half space view through the flock, members wandering across its plane are culled and shown again.
+	TArray<FPlane> ViewPlanes;
+	ViewPlanes.Add(FPlane(FVector::ForwardVector, FlockActor->GetActorLocation().X));
+	FlockActor->ExtraViewFrustums.Add(FConvexVolume(ViewPlanes));
+
+	// Removed members are hidden, spawned ones are shown again. Commands are queued outside of counted Ticks.
+	TArray<int32> RemovedInstances;
+	for (int32 InstanceIndex = 0; InstanceIndex < 100; ++InstanceIndex)
+	{
+		RemovedInstances.Add(InstanceIndex);
+	}
+	FTransform const SpawnTransform = FlockActor->GetActorTransform();
+	FVector const SpawnExtent(500.f);
+
+	auto QueueMemberCommands = [&](int32 TickIndex)
+	{
+		if (TickIndex % 20 == 5)
+		{
+			FlockActor->RemoveMembers(RemovedInstances);
+		}
+		else if (TickIndex % 20 == 15)
+		{
+			FlockActor->SpawnMembers(RemovedInstances.Num(), SpawnTransform, SpawnExtent);
+		}
+	};
+
+	// Warm up, until buffers, command arrays and task pools reached their size.
+	for (int32 TickIndex = 0; TickIndex < 60; ++TickIndex)
+	{
+		QueueMemberCommands(TickIndex);
+		FlockActor->Tick(DeltaTime);
+		FlockActor->WaitForFlockStep();
+	}
+
+	FlockAllocationCounter Counter(GMalloc);
+	FMalloc* const PreviousMalloc = GMalloc;
+	GMalloc = &Counter;
+
+	for (int32 TickIndex = 0; TickIndex < 60; ++TickIndex)
+	{
+		QueueMemberCommands(TickIndex);
+
+		Counter.bCounting = true;
+		FlockActor->Tick(DeltaTime);
+		Counter.bCounting = false;
+
+		FlockActor->WaitForFlockStep();
+	}
+
+	GMalloc = PreviousMalloc;
+
+	TestEqual(TEXT("Game thread allocations in 60 steady state Ticks"), Counter.NumAllocations, 0);
+	return true;
+}
+
+#endif
@@ -0,0 +1,71 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+class UBodySetup;
+
+// Simple collision of one obstacle, captured on game thread. Body setup must stay alive until the bake is done.
+struct FlockObstacle
+{
+    const UBodySetup* BodySetup = nullptr;
+    FTransform Transform;
+    // Bounds of simple collision in component space, for depth inside the obstacle.
+    FBox LocalBounds = FBox(ForceInit);
+    FBox Bounds = FBox(ForceInit);
+};
+
+// Sparse signed distance field of static obstacles, stored as bricks of voxels near obstacle surfaces.
+// Negative inside obstacles. Bake on any thread, sample from any thread once baked.
+class ADVANCEDFLOCKSYSTEM_API FlockDistanceField
+{
+public:
+
+    // Voxels per brick side. Brick stores (BrickCells + 1)^3 corner samples, so lookup never reads other bricks.
+    static constexpr int32 BrickCells = 4;
+    static constexpr int32 BrickSamples = BrickCells + 1;
+    // Cells of the dense brick index. Bounds needing more are baked with larger voxels, so index and samples stay
+    // below 1 MB and MaxBricks * BrickSamples^3 floats (128 MB) even if every brick is near an obstacle.
+    static constexpr int64 MaxBricks = int64(1) << 18;
+
+    FlockDistanceField();
+
+    // Bake signed distance to simple collision of Obstacles inside Bounds. Bricks farther than MaxDistance from all obstacles are not stored.
+    // Voxel size grows above NewVoxelSize if Bounds need more than MaxBricks.
+    void Bake(const FBox& Bounds, float NewVoxelSize, float NewMaxDistance, const TArray<FlockObstacle>& Obstacles);
+
+    // Trilinear signed distance and its gradient (points away from obstacles, also inside them) at Location.
+    // Returns false far from obstacles or outside bounds.
+    bool Sample(const FVector& Location, float& OutDistance, FVector& OutGradient) const;
+
+    int32 GetNumBricks() const { return BrickSampleData.Num() / (BrickSamples * BrickSamples * BrickSamples); }
+
+    SIZE_T GetAllocatedSize() const { return BrickIndices.GetAllocatedSize() + BrickSampleData.GetAllocatedSize(); }
+
+private:
+
+    int32 GetBrickIndex(int32 X, int32 Y, int32 Z) const
+    {
+        return (Z * NumBricks.Y + Y) * NumBricks.X + X;
+    }
+
+    static int32 GetSampleIndex(int32 X, int32 Y, int32 Z)
+    {
+        return (Z * BrickSamples + Y) * BrickSamples + X;
+    }
+
+    // Signed distance of Location to Obstacle, MaxDistance if it can not be queried.
+    float GetSignedDistance(const FlockObstacle& Obstacle, const FVector& Location) const;
+
+    FVector Origin = FVector::ZeroVector;
+    float VoxelSize = 1.f;
+    float InvVoxelSize = 1.f;
+    float MaxDistance = 0.f;
+    FIntVector NumBricks = FIntVector::ZeroValue;
+
+    // Dense coarse grid of bricks, INDEX_NONE for empty bricks.
+    TArray<int32> BrickIndices;
+    // Samples of all stored bricks, BrickSamples^3 per brick.
+    TArray<float> BrickSampleData;
+};
@@ -0,0 +1,169 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// Bits of FlockMemberStore::Flags.
+namespace FlockMemberFlags
+{
+    enum Type : uint8
+    {
+        None    = 0,
+        Leader  = 1 << 0,
+        // Slot holds a simulated member. Inactive slots are free for spawning.
+        Active  = 1 << 1,
+    };
+}
+
+// 16 bytes aligned stream of flock member state.
+template <typename ElementType>
+using TFlockStream = TArray<ElementType, TAlignedHeapAllocator<16>>;
+
+// Flock members state as structure of arrays. Every member is the same index in all streams.
+struct ADVANCEDFLOCKSYSTEM_API FlockMemberStore
+{
+    // Location in XYZ, uniform mesh scale in W.
+    TFlockStream<FVector4> Positions;
+    // Velocity in XYZ, W is 0.
+    TFlockStream<FVector4> Velocities;
+    TFlockStream<FQuat> Orientations;
+    // Wander location in XYZ, elapsed time since last wander in W.
+    TFlockStream<FVector4> WanderTargets;
+    TFlockStream<uint8> Flags;
+    TFlockStream<int32> InstanceIndices;
+    // Current seed of own random stream, so random numbers do not depend on which thread steps the member.
+    TFlockStream<int32> RandomSeeds;
+
+    int32 Num() const { return Positions.Num(); }
+
+    // Remove all members but keep memory.
+    void Reset()
+    {
+        Positions.Reset();
+        Velocities.Reset();
+        Orientations.Reset();
+        WanderTargets.Reset();
+        Flags.Reset();
+        InstanceIndices.Reset();
+        RandomSeeds.Reset();
+    }
+
+    void Reserve(int32 Number)
+    {
+        Positions.Reserve(Number);
+        Velocities.Reserve(Number);
+        Orientations.Reserve(Number);
+        WanderTargets.Reserve(Number);
+        Flags.Reserve(Number);
+        InstanceIndices.Reserve(Number);
+        RandomSeeds.Reserve(Number);
+    }
+
+    // Resize all streams without shrinking memory. New members are not initialized.
+    void SetNumUninitialized(int32 Number)
+    {
+        Positions.SetNumUninitialized(Number, false);
+        Velocities.SetNumUninitialized(Number, false);
+        Orientations.SetNumUninitialized(Number, false);
+        WanderTargets.SetNumUninitialized(Number, false);
+        Flags.SetNumUninitialized(Number, false);
+        InstanceIndices.SetNumUninitialized(Number, false);
+        RandomSeeds.SetNumUninitialized(Number, false);
+    }
+
+    int32 Add(const FTransform& Transform, int32 InstanceIndex, uint8 MemberFlags, int32 RandomSeed)
+    {
+        Positions.Add(FVector4(Transform.GetLocation(), Transform.GetScale3D().X));
+        Velocities.Add(FVector4(0.f, 0.f, 0.f, 0.f));
+        Orientations.Add(Transform.GetRotation());
+        WanderTargets.Add(FVector4(0.f, 0.f, 0.f, 0.f));
+        Flags.Add(MemberFlags);
+        RandomSeeds.Add(RandomSeed);
+        return InstanceIndices.Add(InstanceIndex);
+    }
+
+    // Append Count members of Other starting from StartIndex.
+    void Append(const FlockMemberStore& Other, int32 StartIndex, int32 Count)
+    {
+        check(StartIndex >= 0 && StartIndex + Count <= Other.Num());
+        Positions.Append(Other.Positions.GetData() + StartIndex, Count);
+        Velocities.Append(Other.Velocities.GetData() + StartIndex, Count);
+        Orientations.Append(Other.Orientations.GetData() + StartIndex, Count);
+        WanderTargets.Append(Other.WanderTargets.GetData() + StartIndex, Count);
+        Flags.Append(Other.Flags.GetData() + StartIndex, Count);
+        InstanceIndices.Append(Other.InstanceIndices.GetData() + StartIndex, Count);
+        RandomSeeds.Append(Other.RandomSeeds.GetData() + StartIndex, Count);
+    }
+
+    void Append(const FlockMemberStore& Other)
+    {
+        Append(Other, 0, Other.Num());
+    }
+
+    // Copy member OtherIndex of Other into member Index.
+    void CopyMember(int32 Index, const FlockMemberStore& Other, int32 OtherIndex)
+    {
+        Positions[Index] = Other.Positions[OtherIndex];
+        Velocities[Index] = Other.Velocities[OtherIndex];
+        Orientations[Index] = Other.Orientations[OtherIndex];
+        WanderTargets[Index] = Other.WanderTargets[OtherIndex];
+        Flags[Index] = Other.Flags[OtherIndex];
+        InstanceIndices[Index] = Other.InstanceIndices[OtherIndex];
+        RandomSeeds[Index] = Other.RandomSeeds[OtherIndex];
+    }
+
+    bool HasFlag(int32 Index, uint8 Flag) const
+    {
+        return (Flags[Index] & Flag) != 0;
+    }
+
+    void SetFlag(int32 Index, uint8 Flag, bool bValue)
+    {
+        Flags[Index] = bValue ? uint8(Flags[Index] | Flag) : uint8(Flags[Index] & ~Flag);
+    }
+
+    FVector GetLocation(int32 Index) const
+    {
+        return FVector(Positions[Index].X, Positions[Index].Y, Positions[Index].Z);
+    }
+
+    FVector GetVelocity(int32 Index) const
+    {
+        return FVector(Velocities[Index].X, Velocities[Index].Y, Velocities[Index].Z);
+    }
+
+    FTransform GetTransform(int32 Index) const
+    {
+        float const Scale = Positions[Index].W;
+        return FTransform(Orientations[Index], GetLocation(Index), FVector(Scale, Scale, Scale));
+    }
+
+    // Move all members by rigid Transform: locations, velocities, orientations and wander targets. Scale of Transform is ignored.
+    void TransformBy(const FTransform& Transform)
+    {
+        FQuat const Rotation = Transform.GetRotation();
+        FVector const Translation = Transform.GetTranslation();
+        for (int32 Index = 0; Index < Num(); ++Index)
+        {
+            Positions[Index] = FVector4(Rotation.RotateVector(GetLocation(Index)) + Translation, Positions[Index].W);
+            Velocities[Index] = FVector4(Rotation.RotateVector(GetVelocity(Index)), 0.f);
+            Orientations[Index] = Rotation * Orientations[Index];
+            FVector4 const& Wander = WanderTargets[Index];
+            WanderTargets[Index] = FVector4(Rotation.RotateVector(FVector(Wander.X, Wander.Y, Wander.Z)) + Translation, Wander.W);
+        }
+    }
+
+    // Memory allocated by all streams.
+    SIZE_T GetAllocatedSize() const
+    {
+        return Positions.GetAllocatedSize() + Velocities.GetAllocatedSize() + Orientations.GetAllocatedSize() + WanderTargets.GetAllocatedSize()
+            + Flags.GetAllocatedSize() + InstanceIndices.GetAllocatedSize() + RandomSeeds.GetAllocatedSize();
+    }
+
+    // Memory used by one member in all streams.
+    static constexpr SIZE_T GetBytesPerMember()
+    {
+        return sizeof(FVector4) * 3 + sizeof(FQuat) + sizeof(uint8) + sizeof(int32) * 2;
+    }
+};
@@ -0,0 +1,28 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Templates/Atomic.h"
+#include "Templates/SharedPointer.h"
+
+// ParallelFor for code that runs every frame. Engine ParallelFor allocates its job data on every call,
+// this one keeps it between calls and dispatches fire and forget tasks of the task graph small task pool.
+// Run is called from one thread at a time.
+class ADVANCEDFLOCKSYSTEM_API FlockParallelFor
+{
+public:
+
+    FlockParallelFor();
+
+    // Call Body(Index) for every Index from 0 to Num - 1, in chunks of ChunkSize, on calling thread and worker threads.
+    // Returns when all chunks are done.
+    void Run(int32 Num, int32 ChunkSize, TFunctionRef<void(int32)> Body);
+
+    // Job data shared with tasks. Tasks may start after Run returned, they take no chunk then.
+    struct Job;
+
+private:
+
+    TSharedRef<Job, ESPMode::ThreadSafe> CurrentJob;
+};
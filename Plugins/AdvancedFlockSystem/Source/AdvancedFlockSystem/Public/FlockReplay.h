@@ -0,0 +1,125 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "FlockMemberStore.h"
+
+// Quantized flock trajectories for offline profiling and bug repro. One frame per flock step, every member of the step in every frame:
+// 16 bit positions in recording bounds, smallest three quaternions, half float scale and flags.
+// Frames store zigzag varint deltas to the previous frame, keyframes every KeyframeInterval frames store deltas to zero.
+namespace FlockReplay
+{
+    // "FLRP"
+    static constexpr uint32 Magic = 0x50524C46;
+    static constexpr uint32 Version = 2;
+    // Frame data is indexed by int32, recording stops before it would grow past this.
+    static constexpr int64 MaxFrameDataBytes = int64(1) << 30;
+
+    struct Header
+    {
+        uint32 Magic = 0;
+        uint32 Version = 0;
+        // Most members of any frame, every frame stores its own count.
+        int32 NumMembers = 0;
+        int32 NumFrames = 0;
+        int32 KeyframeInterval = 0;
+        FVector BoundsMin = FVector::ZeroVector;
+        FVector BoundsSize = FVector::ZeroVector;
+    };
+
+    // Quantized member, in field order of frame encoding.
+    struct QuantizedMember
+    {
+        enum Field : uint8
+        {
+            X, Y, Z,
+            // Index of the dropped largest component and the other three.
+            QuatIndex, QuatA, QuatB, QuatC,
+            // Half float bits of scale.
+            Scale,
+            Flags,
+            Num
+        };
+
+        int32 Values[Num] = {};
+    };
+}
+
+// Records frames of one flock. Chunks of a step encode in parallel, step thread joins them in EndFrame.
+class ADVANCEDFLOCKSYSTEM_API FlockReplayRecorder
+{
+public:
+
+    // Members outside of Bounds are clamped to it.
+    FlockReplayRecorder(const FBox& Bounds, int32 KeyframeInterval);
+
+    // Step thread, before chunks. NumMembers may change between frames, new members start from zero.
+    void BeginFrame(int32 NumChunks, int32 NumMembers);
+    // Encode members FirstMember to LastMember - 1 of this frame. Worker threads, one call per chunk.
+    void EncodeChunk(int32 ChunkIndex, const FlockMemberStore& Members, int32 FirstMember, int32 LastMember);
+    // Step thread, after all chunks. FrameDeltaTime is game time of the step, StepTime its wall time.
+    void EndFrame(float FrameDeltaTime, float StepTime);
+
+    // Game thread, while no step is running.
+    bool Save(const FString& FileName) const;
+    // Log size per member per second and encoding time relative to step time.
+    void LogSummary(int32 NumActiveMembers) const;
+
+    int32 GetNumFrames() const { return NumFrames; }
+    // Frames after MaxFrameDataBytes are not recorded.
+    bool IsFull() const { return bFull; }
+    int64 GetNumBytes() const { return sizeof(FlockReplay::Header) + KeyframeOffsets.Num() * sizeof(int64) + FrameData.Num(); }
+    // Game time of all frames.
+    double GetDuration() const { return Duration; }
+    // Wall time of recorded steps and of encoding them.
+    double GetStepSeconds() const { return StepSeconds; }
+    double GetRecordSeconds() const { return FPlatformTime::ToSeconds64(uint64(RecordCycles)); }
+
+private:
+
+    FlockReplay::Header FileHeader;
+    // Quantized members of the previous frame.
+    TArray<FlockReplay::QuantizedMember> PreviousMembers;
+    // Encoded chunks of current frame.
+    TArray<TArray<uint8>> ChunkData;
+    int32 FrameNumMembers = 0;
+    bool bKeyframe = true;
+    bool bFull = false;
+
+    TArray<uint8> FrameData;
+    // Offset of every keyframe in FrameData.
+    TArray<int64> KeyframeOffsets;
+    int32 NumFrames = 0;
+    double Duration = 0.0;
+    double StepSeconds = 0.0;
+    // Summed over workers.
+    volatile int64 RecordCycles = 0;
+};
+
+// Decodes frames of a recording in order.
+class ADVANCEDFLOCKSYSTEM_API FlockReplayPlayer
+{
+public:
+
+    bool Load(const FString& FileName);
+
+    int32 GetNumMembers() const { return FileHeader.NumMembers; }
+    int32 GetNumFrames() const { return FileHeader.NumFrames; }
+    // Game time of the next frame, wraps to the first frame after the last one.
+    float GetNextFrameDeltaTime() const;
+
+    // Decode next frame into Members, resized to GetNumMembers. Velocities are not recorded and stay zero.
+    // Members not in the frame keep their last state. Stops at the first frame that does not fit its data.
+    void DecodeNextFrame(FlockMemberStore& Members);
+
+private:
+
+    FlockReplay::Header FileHeader;
+    TArray<int64> KeyframeOffsets;
+    TArray<uint8> FrameData;
+    TArray<FlockReplay::QuantizedMember> PreviousMembers;
+    int32 NextFrame = 0;
+    int64 NextFrameOffset = 0;
+    bool bCorrupt = false;
+};
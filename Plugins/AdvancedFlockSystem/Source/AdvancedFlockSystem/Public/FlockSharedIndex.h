@@ -0,0 +1,43 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "FlockMemberStore.h"
+#include "FlockSpatialGrid.h"
+
+// Active members of all flocks of a world, one grid per flock, for interaction between flocks.
+// Queries visit only flocks they react on, never the own flock. Built by the flock subsystem once per batch, read only while the batch runs.
+class ADVANCEDFLOCKSYSTEM_API FlockSharedIndex
+{
+public:
+
+    // Remove all flocks but keep memory.
+    void Reset();
+
+    // Add active members of the next flock. Flock index is the order of AddFlock calls.
+    void AddFlock(const FlockMemberStore& Members);
+
+    // Cell size should be equal to the largest query radius.
+    void Build(float CellSize);
+
+    // Call Func(Location) for every member of flock FlockIndex closer than Radius to Location.
+    template <typename FuncType>
+    void ForEachInRadius(int32 FlockIndex, const FVector& Location, float Radius, FuncType Func) const
+    {
+        const TArray<FVector4>& Positions = FlockPositions[FlockIndex];
+        FlockGrids[FlockIndex].ForEachInRadius(Location, Radius, [&Positions, &Func](int32 Entry)
+        {
+            Func(FVector(Positions[Entry].X, Positions[Entry].Y, Positions[Entry].Z));
+        });
+    }
+
+    int32 GetNumFlocks() const { return NumFlocks; }
+
+private:
+
+    // Positions of active members and grid of every flock. Kept between batches, only the first NumFlocks are used.
+    TArray<TArray<FVector4>> FlockPositions;
+    TArray<FlockSpatialGrid> FlockGrids;
+    int32 NumFlocks = 0;
+};
@@ -0,0 +1,34 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "FlockMemberStore.h"
+
+// Binary snapshot of flock members for warm start, relative to the flock actor. Header followed by raw member streams, every stream 16 bytes aligned,
+// so loading is one memcpy per stream from a memory mapped file. Native byte order, load it on the platform that saved it.
+namespace FlockSnapshot
+{
+    // "FLCK"
+    static constexpr uint32 Magic = 0x4B434C46;
+    // Bump when FlockMemberStore streams change. 2: members relative to actor, seed at save.
+    static constexpr uint32 Version = 2;
+    static constexpr int32 NumStreams = 7;
+
+    struct Header
+    {
+        uint32 Magic = 0;
+        uint32 Version = 0;
+        int32 NumMembers = 0;
+        // Current seed of spawn random stream at save, spawning continues the sequence.
+        int32 SimulationSeed = 0;
+        // Byte offset of every stream from file start, in FlockMemberStore order.
+        uint64 StreamOffsets[NumStreams] = {};
+    };
+
+    // Save Members to FileName. Returns false if file could not be written.
+    ADVANCEDFLOCKSYSTEM_API bool Save(const FString& FileName, const FlockMemberStore& Members, int32 SimulationSeed);
+
+    // Load members saved by Save. Returns false for missing, other version or truncated files, OutMembers is not changed then.
+    ADVANCEDFLOCKSYSTEM_API bool Load(const FString& FileName, FlockMemberStore& OutMembers, int32& OutSimulationSeed);
+}
@@ -0,0 +1,100 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// Uniform spatial hash grid for flock mates neighbor search. Rebuild it once per step.
+class ADVANCEDFLOCKSYSTEM_API FlockSpatialGrid
+{
+public:
+
+    FlockSpatialGrid();
+
+    // Rebuild grid from positions. Cell size should be equal to query radius (27 cells per query).
+    // Only XYZ of positions are used. With Flags, only positions with all RequiredFlags are added.
+    void Build(const FVector4* Positions, int32 NumPositions, float NewCellSize, const uint8* Flags = nullptr, uint8 RequiredFlags = 0);
+
+    // Call Func(Index) for every position closer than Radius to Location.
+    template <typename FuncType>
+    void ForEachInRadius(const FVector& Location, float Radius, FuncType Func) const;
+
+    // Most positions FindNearest returns, its distances stay in inline memory up to this count.
+    static constexpr int32 MaxNearest = 32;
+
+    // Up to MaxCount (at most MaxNearest) nearest positions closer than Radius to Location, nearest first, ExcludeIndex skipped.
+    // Visits rings of cells outward and stops when the next ring can not be closer, so dense clusters do not visit more cells.
+    void FindNearest(const FVector& Location, float Radius, int32 MaxCount, int32 ExcludeIndex, TArray<int32>& OutIndices) const;
+
+    int32 Num() const { return SortedIndices.Num(); }
+
+    float GetCellSize() const { return CellSize; }
+
+    SIZE_T GetAllocatedSize() const
+    {
+        return BucketStart.GetAllocatedSize() + BucketCursor.GetAllocatedSize() + PositionBuckets.GetAllocatedSize()
+            + SortedIndices.GetAllocatedSize() + SortedPositions.GetAllocatedSize() + SortedCells.GetAllocatedSize();
+    }
+
+private:
+
+    template <typename VectorType>
+    FIntVector GetCell(const VectorType& Location) const
+    {
+        return FIntVector(FMath::FloorToInt(Location.X * InvCellSize),
+                          FMath::FloorToInt(Location.Y * InvCellSize),
+                          FMath::FloorToInt(Location.Z * InvCellSize));
+    }
+
+    int32 GetBucket(const FIntVector& Cell) const
+    {
+        uint32 const Hash = (uint32(Cell.X) * 73856093u) ^ (uint32(Cell.Y) * 19349663u) ^ (uint32(Cell.Z) * 83492791u);
+        return int32(Hash & BucketMask);
+    }
+
+    float CellSize = 1.f;
+    float InvCellSize = 1.f;
+    uint32 BucketMask = 0;
+
+    // First sorted slot of every bucket (NumBuckets + 1 entries).
+    TArray<int32> BucketStart;
+    // Write cursor per bucket, used only while building.
+    TArray<int32> BucketCursor;
+    // Bucket of every input position, used only while building.
+    TArray<int32> PositionBuckets;
+
+    // Sorted by bucket. Cells are stored to skip hash collisions.
+    TArray<int32> SortedIndices;
+    TArray<FVector> SortedPositions;
+    TArray<FIntVector> SortedCells;
+};
+
+template <typename FuncType>
+void FlockSpatialGrid::ForEachInRadius(const FVector& Location, float Radius, FuncType Func) const
+{
+    if (SortedIndices.Num() == 0) return;
+
+    float const RadiusSquared = FMath::Square(Radius);
+    int32 const Range = FMath::Max(1, FMath::CeilToInt(Radius * InvCellSize));
+    FIntVector const CenterCell = GetCell(Location);
+
+    for (int32 Z = -Range; Z <= Range; ++Z)
+    {
+        for (int32 Y = -Range; Y <= Range; ++Y)
+        {
+            for (int32 X = -Range; X <= Range; ++X)
+            {
+                FIntVector const Cell(CenterCell.X + X, CenterCell.Y + Y, CenterCell.Z + Z);
+                int32 const Bucket = GetBucket(Cell);
+
+                for (int32 Slot = BucketStart[Bucket]; Slot < BucketStart[Bucket + 1]; ++Slot)
+                {
+                    if (SortedCells[Slot] == Cell && FVector::DistSquared(SortedPositions[Slot], Location) < RadiusSquared)
+                    {
+                        Func(SortedIndices[Slot]);
+                    }
+                }
+            }
+        }
+    }
+}
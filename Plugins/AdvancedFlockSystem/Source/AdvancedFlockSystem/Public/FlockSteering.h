@@ -0,0 +1,32 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// Sums over flock mates needed by cohesion, alignment and separation.
+struct FlockMatesSums
+{
+    FVector Position = FVector::ZeroVector;
+    FVector Velocity = FVector::ZeroVector;
+    // Sum of (Location - MatePosition) / DistanceSquared.
+    FVector Separation = FVector::ZeroVector;
+    int32 Num = 0;
+};
+
+// Steering kernels over 16 bytes aligned FVector4 streams.
+class ADVANCEDFLOCKSYSTEM_API FlockSteering
+{
+public:
+
+    // One pass over mates for cohesion, alignment and separation. Uses vector registers, 4 mates at once.
+    static void AccumulateMates(const FVector4* Positions, const FVector4* Velocities, const int32* Mates, int32 NumMates,
+                                const FVector& Location, FlockMatesSums& OutSums);
+
+    // Scalar fallback of AccumulateMates, gives the same result within float tolerance.
+    static void AccumulateMatesScalar(const FVector4* Positions, const FVector4* Velocities, const int32* Mates, int32 NumMates,
+                                      const FVector& Location, FlockMatesSums& OutSums);
+
+    // True if AccumulateMates should be used instead of scalar fallback (Flock.VectorizedSteering).
+    static bool UseVectorizedSteering();
+};
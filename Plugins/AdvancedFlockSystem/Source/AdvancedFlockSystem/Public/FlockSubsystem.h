@@ -0,0 +1,64 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Subsystems/WorldSubsystem.h"
+#include "Tickable.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "FlockSharedIndex.h"
+#include "FlockSubsystem.generated.h"
+
+class AFlockSystemActor;
+class FlockSimulation;
+
+// Steps all flock actors of a world in one job per frame. Flocks queue their step in Tick,
+// the subsystem ticks after actors and runs grids and chunks of all queued flocks in shared ParallelFors.
+// Every flock keeps its own buffers and reads its own result in the next Tick.
+// Members of all registered flocks go into one shared index per batch, flocks react on each other by their interaction rules.
+UCLASS()
+class ADVANCEDFLOCKSYSTEM_API UFlockSubsystem : public UWorldSubsystem, public FTickableGameObject
+{
+    GENERATED_BODY()
+
+public:
+
+    virtual void Deinitialize() override;
+
+    // Called by flock actors in BeginPlay and EndPlay.
+    void RegisterFlock(AFlockSystemActor* FlockActor);
+    void UnregisterFlock(AFlockSystemActor* FlockActor);
+
+    // Wait for running batch.
+    void EnsureCompletion();
+
+    // Start one batch of all flocks that queued a step this frame.
+    virtual void Tick(float DeltaTime) override;
+    virtual ETickableTickType GetTickableTickType() const override;
+    virtual bool IsTickable() const override;
+    virtual UWorld* GetTickableGameObjectWorld() const override { return GetWorld(); }
+    virtual TStatId GetStatId() const override;
+
+private:
+
+    // Whole batch, runs on a worker thread.
+    void StepBatch();
+
+    UPROPERTY()
+    TArray<AFlockSystemActor*> FlockActors;
+
+    FGraphEventRef BatchTask;
+    // Simulations of the running batch.
+    TArray<FlockSimulation*> BatchSimulations;
+
+    // All registered flocks at batch start, indexed by flock index of SharedIndex.
+    TArray<FlockSimulation*> IndexSimulations;
+    TArray<FName> IndexFlockTypes;
+    // Flock index of every batch simulation.
+    TArray<int32> BatchFlockIndices;
+    FlockSharedIndex SharedIndex;
+    TArray<int32> BatchNumChunks;
+    // Simulations with substep left in current substep, and first chunk of each in one flat range with total at the end.
+    TArray<int32> SubstepSimulations;
+    TArray<int32> SubstepChunkStarts;
+};
@@ -4,67 +4,201 @@
 
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
-#include "Runtime/Core/Public/HAL/Runnable.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "Async/ParallelFor.h"
+#include "FlockSpatialGrid.h"
+#include "FlockMemberStore.h"
+#include "FlockSteering.h"
+#include "FlockTripleBuffer.h"
+#include "FlockDistanceField.h"
+#include "FlockSharedIndex.h"
+#include "FlockReplay.h"
+#include "FlockParallelFor.h"
+#include "ConvexVolume.h"
+#include "Engine/NetSerialization.h"
 #include "FlockSystemActor.generated.h"
 
-USTRUCT(BlueprintType)
-struct FlockMemberData
+// Simulation LOD of flock member, by distance to the nearest player view.
+namespace FlockLOD
 {
-    GENERATED_USTRUCT_BODY()
+    enum Type : uint8
+    {
+        // Full steering every step.
+        Near,
+        // Full steering every LODMidStepInterval steps, dead reckoning in between.
+        Mid,
+        // Only follow and cohesion every LODFarStepInterval steps.
+        Far,
+        Num
+    };
+}
 
-    UPROPERTY()
-    int InstanceIndex = 0;
+// Rendered state of flock instance.
+namespace FlockInstanceState
+{
+    enum Type : uint8
+    {
+        // Transform updated every frame.
+        Visible,
+        // Outside of all views, keeps its last transform.
+        Culled,
+        // Zero scale, free slot or member not simulated yet.
+        Hidden,
+    };
+}
 
-    UPROPERTY()
-    FVector Velocity = FVector::ZeroVector;
+// Steering behaviors timed for stat Flock.
+namespace FlockBehavior
+{
+    enum Type : uint8
+    {
+        NeighborQuery,
+        SteeringAccumulate,
+        Flee,
+        Avoidance,
+        Aquarium,
+        Interaction,
+        Num
+    };
+}
 
-    UPROPERTY()
-    FVector WanderPosition = FVector::ZeroVector;
+// Result of one flock step, exchanged with game thread through triple buffer.
+struct FlockStepResult
+{
+    FlockMemberStore Members;
+    // Actors attacked by flock members in this step.
+    TArray<AActor*> AttackedActors;
+    // Positions and orientations before the last substep, for render interpolation.
+    TFlockStream<FVector4> PreviousPositions;
+    TFlockStream<FQuat> PreviousOrientations;
+    // Members in every LOD at the last substep.
+    int32 NumMembersInLOD[FlockLOD::Num] = {};
+    // Wall time of the whole step in seconds.
+    float StepTime = 0.f;
+    // Substeps simulated since start up to this result.
+    int32 StepNumber = 0;
+    // Stats of all substeps. Behavior times in milliseconds summed over workers, 0 without Flock.DetailedStats.
+    int32 NumNeighborsVisited = 0;
+    int32 NumAvoidanceTriggers = 0;
+    float BehaviorTimes[FlockBehavior::Num] = {};
+};
 
-    UPROPERTY()
+// Collision bounds of an obstacle that is not static, avoided live instead of baked.
+struct FlockMovingObstacle
+{
     FTransform Transform;
+    // Bounds in space of Transform.
+    FBox LocalBounds = FBox(ForceInit);
+};
 
-    UPROPERTY()
-    float ElapsedTimeSinceLastWander = 0.f;
-
-    UPROPERTY()
-    bool bIsFlockLeader = false;
-
-    UPROPERTY()
-    TArray<AActor*> AttackedActors;
+// Game thread state read by flock step. Built before every step, so workers never touch UObjects.
+struct FlockWorldSnapshot
+{
+    // Locations of valid danger actors, DangerActors[i] is at DangerLocations[i].
+    TArray<FVector> DangerLocations;
+    // Only passed back in attacked actors, never dereferenced by workers.
+    TArray<AActor*> DangerActors;
+    FVector FollowLocation = FVector::ZeroVector;
+    bool bHasFollowActor = false;
+    // Box component location and scaled extent.
+    FVector AquariumCenter = FVector::ZeroVector;
+    FVector AquariumExtent = FVector::ZeroVector;
+    float MaxHeight = 0.f;
+    // View locations of all players.
+    TArray<FVector> ViewLocations;
+    // Avoided obstacles that are not static, at their pose of this frame.
+    TArray<FlockMovingObstacle> MovingObstacles;
+};
 
-    FlockMemberData()
+// Kinds of FlockMemberCommand.
+namespace FlockMemberCommandType
+{
+    enum Type : uint8
     {
-        InstanceIndex = 0;
-        Velocity = FVector::ZeroVector;
-        ElapsedTimeSinceLastWander = 0.0f;
-        WanderPosition = FVector::ZeroVector;
-        bIsFlockLeader = false;
+        Spawn,
+        Remove,
+        // Server location and velocity of a replicated flock member.
+        Correct,
+        // Server wander target of a replicated flock leader.
+        Wander
     };
+}
+
+// Change of one member slot, applied by flock step.
+struct FlockMemberCommand
+{
+    int32 Slot = INDEX_NONE;
+    FlockMemberCommandType::Type Type = FlockMemberCommandType::Remove;
+    // Spawn transform in world space.
+    FTransform Transform;
+    // Correction location and velocity, wander target in Location.
+    FVector Location = FVector::ZeroVector;
+    FVector Velocity = FVector::ZeroVector;
+    // Substep of own simulation the correction state belongs to, extrapolated to the substep it is applied in.
+    int32 StepNumber = 0;
+    int32 RandomSeed = 0;
 };
 
-USTRUCT(BlueprintType)
-struct FlockMembersArrays
+// Spawn or remove sent from server to clients of replicated flock.
+USTRUCT()
+struct FlockNetMemberCommand
 {
     GENERATED_USTRUCT_BODY()
 
     UPROPERTY()
-    int InstanceIndex = 0;
+    int32 Slot = INDEX_NONE;
+    UPROPERTY()
+    bool bSpawn = false;
+    UPROPERTY()
+    FVector_NetQuantize10 Location;
+    UPROPERTY()
+    FQuat Rotation = FQuat::Identity;
+    UPROPERTY()
+    float Scale = 1.f;
+    UPROPERTY()
+    int32 RandomSeed = 0;
+};
+
+// Quantized locations and velocities of a range of member slots of replicated flock.
+USTRUCT()
+struct FlockNetCorrections
+{
+    GENERATED_USTRUCT_BODY()
 
     UPROPERTY()
-    TArray<FlockMemberData> FlockMembersArr;
+    int32 FirstSlot = 0;
+    // Server substep of these states, clients extrapolate them to their own substep.
+    UPROPERTY()
+    int32 ServerStep = 0;
+    // Locations are 16 bit in these bounds, velocities 8 bit up to MaxSpeed.
+    UPROPERTY()
+    FVector BoundsMin = FVector::ZeroVector;
+    UPROPERTY()
+    FVector BoundsSize = FVector::ZeroVector;
+    UPROPERTY()
+    float MaxSpeed = 0.f;
+    // XYZ of every member.
+    UPROPERTY()
+    TArray<uint16> Locations;
+    UPROPERTY()
+    TArray<int8> Velocities;
+    // Bit i is set if slot FirstSlot + i is active on server. Clients that missed spawns or removes (e.g. joined late) spawn
+    // and remove by it, corrections apply only to active slots.
+    UPROPERTY()
+    TArray<uint8> ActiveMask;
+};
 
-    FlockMembersArrays()
-    {
-        InstanceIndex = 0;
-        FlockMembersArr.Empty();
-    };
+USTRUCT()
+struct FlockNetLeaderWander
+{
+    GENERATED_USTRUCT_BODY()
 
-    void AddData(int Index, TArray<FlockMemberData> NewFlockData)
-    {
-        InstanceIndex = Index;
-        FlockMembersArr = NewFlockData;
-    };
+    UPROPERTY()
+    int32 Slot = INDEX_NONE;
+    UPROPERTY()
+    FVector_NetQuantize WanderTarget;
+
+    bool operator==(const FlockNetLeaderWander& Other) const { return Slot == Other.Slot && WanderTarget == Other.WanderTarget; }
 };
 
 UENUM(BlueprintType)
@@ -79,6 +213,32 @@ enum class EPriority: uint8
     TimeCritical		UMETA(DisplayName = "TimeCritical")
 };
 
+// Reaction of flock members to members of other flocks.
+UENUM(BlueprintType)
+enum class EFlockInteraction: uint8
+{
+    Flee				UMETA(DisplayName = "Flee"),
+    Chase				UMETA(DisplayName = "Chase"),
+    Avoid				UMETA(DisplayName = "Avoid")
+};
+
+USTRUCT(BlueprintType)
+struct FlockInteractionRule
+{
+    GENERATED_USTRUCT_BODY()
+
+    // Flock type of other flocks this rule applies to.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
+    FName OtherFlockType;
+    // Flee runs away like from danger actors, chase steers to the nearest member, avoid only keeps distance.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
+    EFlockInteraction Interaction = EFlockInteraction::Flee;
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters", meta=(ClampMin="0"))
+    float Radius = 500.f;
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters", meta=(ClampMin="0"))
+    float Scale = 10.f;
+};
+
 USTRUCT(BlueprintType)
 struct FlockMemberParameters
 {
@@ -90,8 +250,8 @@ struct FlockMemberParameters
     bool bUseOneLeader = false;
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn")
     AActor* FollowActor = nullptr;
-    // Use for only more flock mates!
-    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn")
+    // Deprecated, flock step runs on shared engine worker threads and does not sleep.
+    UPROPERTY(BlueprintReadWrite, Category = "Advanced Flock Spawn", meta=(DeprecatedProperty, DeprecationMessage="Flock step runs on shared engine worker threads and does not sleep, this option does nothing."))
     bool ExperimentalOptimization = false;
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn")
     bool bUseAquarium = true;
@@ -123,6 +283,38 @@ struct FlockMemberParameters
     float MaxHeight = 0.f;
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn")
     float MoveSpeedInterpInThread = 5.f;
+    // Step simulation with fixed time step and interpolate instances between the last two steps.
+    // Off by default, so existing flocks keep stepping with frame time.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn")
+    bool bUseFixedTimeStep = false;
+    // Fixed steps per second.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn", meta=(ClampMin="1"))
+    float FixedStepRate = 30.f;
+    // Max fixed steps in one frame, the rest of frame time is dropped.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn", meta=(ClampMin="1"))
+    int32 MaxSubsteps = 4;
+    // Seed of spawn and member random streams, 0 picks a random seed unless bDeterministic.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn")
+    int32 RandomSeed = 0;
+    // Same seed and fixed step rate give the same trajectories. Forces fixed time step and turns simulation LOD off.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn")
+    bool bDeterministic = false;
+    // Step members far from all player views less often and with less steering.
+    // Off by default, so existing flocks keep full steering for every member.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn")
+    bool bUseSimulationLOD = false;
+    // Members closer to a player view get full steering every step.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn", meta=(EditCondition="bUseSimulationLOD"))
+    float LODMidDistance = 5000.f;
+    // Members farther from all player views get only follow and cohesion.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn", meta=(EditCondition="bUseSimulationLOD"))
+    float LODFarDistance = 15000.f;
+    // Steps between full updates of mid members, they keep their velocity in between.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn", meta=(EditCondition="bUseSimulationLOD", ClampMin="1"))
+    int32 LODMidStepInterval = 2;
+    // Steps between updates of far members.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn", meta=(EditCondition="bUseSimulationLOD", ClampMin="1"))
+    int32 LODFarStepInterval = 6;
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
     float FlockMaxSpeed = 40.0f;
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
@@ -133,6 +325,10 @@ struct FlockMemberParameters
     float FollowScale = 1.0f;
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
     float FlockMateAwarenessRadius = 400.0f;
+    // Only this many nearest flock mates inside FlockMateAwarenessRadius steer a member, e.g. 7. 0 uses all of them.
+    // Keeps step cost per member bounded in dense clusters. At most FlockSpatialGrid::MaxNearest.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters", meta=(ClampMin="0", ClampMax="32"))
+    int32 MaxFlockMates = 0;
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
     float AlignScale = 0.4f;
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
@@ -145,6 +341,9 @@ struct FlockMemberParameters
     float FleeScaleAvoidance = 10.0f;
 
     float AvoidancePrimitiveDistance = 50.f;
+    // Voxel size of baked avoidance distance field.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters", meta=(ClampMin="1"))
+    float AvoidanceFieldVoxelSize = 25.f;
     
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
     float SeparationRadius = 6.0f;
@@ -169,6 +368,13 @@ struct FlockMemberParameters
     float FleeScaleAquarium = 10.0f;
     float StrengthAquariumOffsetValue = 100.f;
 
+    // Type of this flock, matched by interaction rules of other flocks.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
+    FName FlockType;
+    // Reactions to members of other flocks of the world. Only flocks simulated in world subsystem interact.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
+    TArray<FlockInteractionRule> InteractionRules;
+
 
     FlockMemberParameters()
     {
@@ -190,6 +396,10 @@ public:
     // Called every frame
     virtual void Tick(float DeltaTime) override;
 
+    virtual void OnConstruction(const FTransform& Transform) override;
+
+    virtual void GetLifetimeReplicatedProps(TArray<FLifetimeProperty>& OutLifetimeProps) const override;
+
     //************************************************************************
     // Component                                                                  
     //************************************************************************
@@ -203,18 +413,46 @@ public:
 
     //************************************************************************
 
-    void GenerateFlockThread();
+    void GenerateFlockSimulation();
 
     void AddAvoidanceComponentsTimer();
 
+    // Block until running flock step is finished, its result is used by next Tick.
+    void WaitForFlockStep();
+
+    class FlockSimulation* GetSimulation() const { return Simulation; }
+
+    // Start async bake of distance field of static obstacles if they changed since the last bake. Game thread only.
+    void BakeAvoidanceField();
+    // Block until running avoidance bake is done and use its field in the next step.
+    void WaitForAvoidanceBake();
+
+    // Memory of flock members, instance state, simulation and avoidance field. Call only while step is not running.
+    SIZE_T GetFlockAllocatedSize() const;
+
+    // Read danger actors, follow actor and box component into WorldSnapshot.
+    void UpdateWorldSnapshot();
+
+    // Frustums of local player views for view culling.
+    void UpdateViewFrustums();
+    bool IsInAnyViewFrustum(const FVector& Location, float Radius) const;
+
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn")
     UStaticMesh* StaticMesh;
-    // Recommended - 1 Thread = (2000 - 2500) mates. 
+    // Number of flock groups, every group has own leader. Not a thread count, step of all groups runs on shared engine worker threads.
+    // Was MaxUseThreads, see CoreRedirects in Config/DefaultAdvancedFlockSystem.ini.
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn", meta=(ClampMin="1", ClampMax="32"))
-    int MaxUseThreads = 1;
-    // Recommended - 1 Thread = (2000 - 2500) mates.
+    int32 NumFlockGroups = 1;
+    // Number of flock members spawned at BeginPlay.
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn")
     int32 FlockMateInstances = 1000;
+    // Member slots and instances created at BeginPlay, SpawnMembers reuses free slots. Not less than FlockMateInstances.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn")
+    int32 MaxFlockMembers = 0;
+    // Snapshot saved by SaveFlockSnapshot to start from instead of random spawn. Relative paths are in Saved/Flock.
+    // Missing or old snapshot falls back to random spawn.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn")
+    FString WarmStartSnapshot;
     // Random mesh scale.
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn")
     float MinMeshScale = 1.f;
@@ -225,24 +463,90 @@ public:
     float InterpMoveAnimRate = 200.f;
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
     float InterpRotateAnimRate = 25.f;
+    // Skip instance updates of members outside of all local player views.
+    // Off by default, so existing flocks keep updating every instance, also for views not owned by a local player (scene captures).
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
+    bool bUseViewCulling = false;
+    // Views for view culling besides local player views, e.g. of scene captures. Kept until changed, game thread only.
+    TArray<FConvexVolume> ExtraViewFrustums;
+    // Added to mesh bounds in view culling, so members do not pop in at screen edges.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters", meta=(EditCondition="bUseViewCulling", ClampMin="0"))
+    float ViewCullingPadding = 200.f;
+    // Per instance custom data floats for vertex animation material. 0 is animation phase in [0, 1), 1 is speed / FlockMaxSpeed, the rest is unused.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Spawn", meta=(ClampMin="0", ClampMax="8"))
+    int32 NumCustomDataFloats = 0;
+    // Animation cycles per second at FlockMaxSpeed.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters", meta=(ClampMin="0"))
+    float AnimationPhaseRate = 2.f;
+    // Step together with all flocks of the world in one job of the flock world subsystem. Off starts own step task from Tick.
+    // Read at BeginPlay. Thread priority applies only to own step task. Interaction rules need it.
+    // Off by default, so existing flocks keep stepping in their own task right after their Tick.
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
+    bool bSimulateInWorldSubsystem = false;
+    // Server simulates and replicates seed, leader wander targets, danger actors, spawns and removes. Clients simulate the same
+    // flock and get quantized corrections and active slots of NetCorrectionsPerUpdate members every NetUpdateInterval, extrapolated
+    // from the server step to their own. Forces bDeterministic.
+    UPROPERTY(BlueprintReadOnly, EditAnywhere, Category = "Advanced Flock Parameters")
+    bool bReplicateFlock = false;
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters", meta=(EditCondition="bReplicateFlock", ClampMin="0.05"))
+    float NetUpdateInterval = 0.5f;
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters", meta=(EditCondition="bReplicateFlock", ClampMin="0"))
+    int32 NetCorrectionsPerUpdate = 256;
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Advanced Flock Parameters")
     FlockMemberParameters FlockParameters;
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Advanced Flock Parameters")
     TArray<AActor*> AvoidanceActorRootArr;
-    UPROPERTY(BlueprintReadOnly, Category = "Advanced Flock Parameters")
-    TArray<FlockMemberData> FlockMemberDataArr;
-    // Add an instance to this component. Transform is given in world space. 
-    void AddFlockMemberWorldSpace(const FTransform& WorldTransform);
+    // Wall time in seconds of the step shown by the last Tick.
+    float LastStepTime = 0.f;
+    // Flock members spawned at BeginPlay.
+    FlockMemberStore FlockMembers;
+    // Interpolated locations of instances.
+    TArray<FVector> RenderedLocations;
+    // FlockInstanceState of every instance, indexed by InstanceIndex. Bytes, so workers write own elements.
+    TArray<uint8> InstanceStates;
+    // Instance transform changed this frame and is uploaded after the update.
+    TArray<uint8> InstanceDirty;
+    // Animation phase written into custom data, indexed by InstanceIndex.
+    TArray<float> AnimationPhases;
+    // Custom data floats written by flock, phase and speed of every instance. Set on the component through SetCustomDataValue,
+    // so its render state takes them like any other custom data.
+    static constexpr int32 MaxAnimationDataFloats = 2;
+    TArray<float> InstanceAnimationData;
+    // Render ready transforms of instances in component space, indexed by InstanceIndex. Dirty ones are uploaded once per frame.
+    TArray<FTransform> InstanceTransforms;
+    // Add an instance to this component. Transform is given in world space. Not active members are free slots.
+    void AddFlockMemberWorldSpace(const FTransform& WorldTransform, bool bActive = true);
+
+    // Spawn up to Count members at random locations in box of SpawnExtent around SpawnTransform. Returns number of spawned members.
+    UFUNCTION(BlueprintCallable, Category = "Advanced Flock")
+    int32 SpawnMembers(int32 Count, const FTransform& SpawnTransform, FVector SpawnExtent);
+    // Remove members by instance index of StaticMeshInstanceComponent (e.g. Item of hit result). Returns number of removed members.
+    UFUNCTION(BlueprintCallable, Category = "Advanced Flock")
+    int32 RemoveMembers(const TArray<int32>& InstanceIndices);
+    UFUNCTION(BlueprintPure, Category = "Advanced Flock")
+    int32 GetNumActiveMembers() const { return NumActiveMembers; }
+    // Save shown state of all member slots for WarmStartSnapshot. Relative paths are in Saved/Flock.
+    UFUNCTION(BlueprintCallable, Category = "Advanced Flock")
+    bool SaveFlockSnapshot(const FString& FileName);
+
+    // Record every step from now on, keyframe every KeyframeInterval steps. Positions outside twice the aquarium box are clamped.
+    UFUNCTION(BlueprintCallable, Category = "Advanced Flock")
+    void StartFlockRecording(int32 KeyframeInterval = 30);
+    // Save recording and log its size per member per second. Relative paths are in Saved/Flock.
+    UFUNCTION(BlueprintCallable, Category = "Advanced Flock")
+    bool StopFlockRecording(const FString& FileName);
+    // Show recorded frames in a loop instead of simulating. Members of the recording map to instances by index.
+    UFUNCTION(BlueprintCallable, Category = "Advanced Flock")
+    bool StartFlockReplay(const FString& FileName);
+    // Continue simulation from its state before replay.
+    UFUNCTION(BlueprintCallable, Category = "Advanced Flock")
+    void StopFlockReplay();
 	// MD
     int32 NumFlock;
 
     UPROPERTY()
     TArray<UPrimitiveComponent*> AllOverlappingComponentsArr;
 
-    TArray<FlockMembersArrays> AllFlockMembersArrays;
-
-    void DivideFlockArrayForThreads();
-
     UPROPERTY()
     TArray<AActor*> DangerActors;
 
@@ -256,93 +560,267 @@ protected:
     virtual void BeginDestroy() override;
 
     FTimerHandle AddAvoidanceActor_Timer;
+    FTimerHandle NetUpdate_Timer;
 
 private:
 
-    TArray<class FlockThread*> FlockActorPoolThreadArr;
+    class FlockSimulation* Simulation = nullptr;
+
+    // Steps are queued for the flock subsystem instead of started here.
+    bool bRegisteredInSubsystem = false;
+
+    void StartSimulationStep(float DeltaTime, int32 NumSubsteps);
+
+    TSharedPtr<FlockReplayRecorder, ESPMode::ThreadSafe> Recorder;
+    TUniquePtr<FlockReplayPlayer> ReplayPlayer;
+    // Shown frame of replay and the one before it.
+    FlockStepResult ReplayResult;
+
+    // Decode replay frames up to game time, like steps for PendingStepTime.
+    const FlockStepResult& AdvanceReplay(float DeltaTime);
+
+    // Spawn members and create simulation. Clients of replicated flock wait for ReplicatedSeed.
+    void SpawnFlock();
+    bool IsReplicatedClient() const;
+    // Spawn or remove on game thread. Server of replicated flock sends it to clients.
+    void QueueMemberCommand(const FlockMemberCommand& Command);
+    // Quantization bounds of replay and corrections, twice the aquarium box.
+    FBox GetQuantizationBounds() const;
+
+    // Server of replicated flock: danger actors, leader wander targets and next corrections. Every NetUpdateInterval.
+    void UpdateFlockReplication();
+
+    UFUNCTION()
+    void OnRep_ReplicatedSeed();
+    UFUNCTION()
+    void OnRep_LeaderWanders();
+    UFUNCTION(NetMulticast, Unreliable)
+    void MulticastFlockCorrections(const FlockNetCorrections& Corrections);
+    UFUNCTION(NetMulticast, Reliable)
+    void MulticastMemberCommands(const TArray<FlockNetMemberCommand>& Commands);
+
+    // Never 0 on server of replicated flock.
+    UPROPERTY(ReplicatedUsing = OnRep_ReplicatedSeed)
+    int32 ReplicatedSeed = 0;
+    UPROPERTY(ReplicatedUsing = OnRep_LeaderWanders)
+    TArray<FlockNetLeaderWander> LeaderWanders;
+    // Danger actors of server, clients flee from the same actors.
+    UPROPERTY(Replicated)
+    TArray<AActor*> ReplicatedDangerActors;
+    // Spawns and removes of this frame, sent in one reliable multicast.
+    TArray<FlockNetMemberCommand> OutgoingNetCommands;
+    // First slot of next corrections.
+    int32 NetCorrectionCursor = 0;
+    // Client: server substep minus own substep, set from the first corrections and again when it drifts by more than a second.
+    int32 NetStepOffset = 0;
+    bool bNetStepSynced = false;
+
+    // Load WarmStartSnapshot into FlockMembers and add instances. Returns false if nothing was loaded.
+    bool LoadWarmStartSnapshot();
+    static FString GetSnapshotPath(const FString& FileName);
+
+    // Game time since the last started step.
+    float PendingStepTime = 0.f;
+
+    // Avoidance components changed, pass them to simulation before next step.
+    bool bAvoidanceDirty = false;
+
+    TSharedPtr<FlockDistanceField, ESPMode::ThreadSafe> AvoidanceField;
+
+    FlockWorldSnapshot WorldSnapshot;
+
+    // Game thread state of member slots, indexed by InstanceIndex. Changes reach simulation through PendingMemberCommands.
+    TArray<uint8> ActiveSlots;
+    TArray<int32> FreeSlots;
+    int32 NumActiveMembers = 0;
+    // Passed to simulation before next step.
+    TArray<FlockMemberCommand> PendingMemberCommands;
+
+    // Seed used this play, member seeds are derived from it.
+    int32 SimulationSeed = 0;
+    // Random stream of spawning on game thread.
+    FRandomStream SpawnRandom;
+    // Frustums of this frame are the first NumViewFrustums, the rest is kept for reuse.
+    TArray<FConvexVolume> ViewFrustums;
+    int32 NumViewFrustums = 0;
+    // Instance update of Tick, without allocations per frame.
+    FlockParallelFor TickParallelFor;
+    static constexpr int32 TickChunkSize = 256;
+    // Components baked into AvoidanceField, sorted.
+    TArray<UPrimitiveComponent*> AvoidanceFieldComponents;
+    // Avoided components that are not static, passed to every step in WorldSnapshot instead of baked.
+    UPROPERTY(Transient)
+    TArray<UPrimitiveComponent*> MovingAvoidanceComponents;
+    // Running bake and its field, swapped into AvoidanceField when done.
+    FGraphEventRef AvoidanceBakeTask;
+    TSharedPtr<FlockDistanceField, ESPMode::ThreadSafe> BakingAvoidanceField;
+    // Collision read by running bake.
+    UPROPERTY(Transient)
+    TArray<UBodySetup*> AvoidanceBakeBodySetups;
+
+    // Swap in field of finished bake. Game thread only.
+    void FinishAvoidanceBake(bool bWait);
 
 };
 
-// Thread
-class FlockThread : public FRunnable
+// Scratch memory of one step chunk. Reused between steps.
+struct FlockChunkScratch
 {
-public:
-
-    //================================= THREAD =====================================
-    
-    //Constructor
-    FlockThread(AActor *NewActor);
-    //Destructor
-    ~FlockThread();
-
-    //Use this method to kill the thread!!
-    void EnsureCompletion();
-    //Pause the thread 
-    void PauseThread();
-    //Continue/UnPause the thread
-    void ContinueThread();
-    //FRunnable interface.
-    bool Init();
-    uint32 Run();
-    void Stop();
-    bool IsThreadPaused() const;
-
-    //================================= FLOCK =====================================
-    class UBoxComponent* BoxComponentRef;
+    TArray<int32> Mates;
+    // Actors attacked by flock members of the chunk.
+    TArray<AActor*> AttackedActors;
+    // Members of the chunk in every LOD.
+    int32 NumMembersInLOD[FlockLOD::Num] = {};
+    // Stats of the chunk summed over substeps.
+    int32 NumNeighborsVisited = 0;
+    int32 NumAvoidanceTriggers = 0;
+    uint64 BehaviorCycles[FlockBehavior::Num] = {};
+};
 
-    TArray<FlockMemberData> GetFlockMembersData();
+// Flock step of one flock actor. Runs as own task on engine worker threads, or in the batch of all flocks of the world (UFlockSubsystem).
+// Members are stepped in small chunks with ParallelFor. Only one step runs at a time, started from game thread.
+class FlockSimulation
+{
+public:
 
-    void InitFlockParameters(TArray<FlockMemberData> SetFlockMembersArr, FlockMemberParameters NewParameters, UBoxComponent* SetBoxComponent);
+    FlockSimulation();
+    ~FlockSimulation();
 
-    void SetOverlappingComponents(TArray<UPrimitiveComponent*> OverlappingComponentsArr, TArray<AActor*> DangerActors);
-    void SetAvoidanceActor(TArray<AActor*> AvoidanceActorRootArr);
+    //================================= TASK =====================================
 
-    FVector SteeringAquarium(FlockMemberData& FlockMember) const;
-    FVector SteeringAvoidanceComponent(FlockMemberData& FlockMember) const;
-    FVector SteeringWander(FlockMemberData& FlockMember) const;
-    FVector GetRandomWanderLocation() const;
-    FVector SteeringFollow(FlockMemberData& FlockMember, int32 FlockLeader);
-    TArray<int32> GetNearbyFlockMates(int32 FlockMember);
-    FVector SteeringAlign(FlockMemberData& FlockMember, TArray<int32>& FlockMates);
-    FVector SteeringSeparate(FlockMemberData& FlockMember, TArray<int32>& FlockMates);
-    FVector SteeringCohesion(FlockMemberData& FlockMember, TArray<int32>& FlockMates);
-    FVector SteeringFlee(FlockMemberData& FlockMember);
-    FVector SteeringAvoidance(FlockMemberData& FlockMember) const;
-    FVector SteeringMaxHeight(FlockMemberData& FlockMember) const;
-    FVector SteeringFollowPawn(FlockMemberData& FlockMember);
+    // Start next step of NumSubsteps substeps on worker threads. Game thread only, returns false if previous step is still running.
+    bool StartStep(float DeltaTime, int32 NumSubsteps);
+    // Running or queued.
+    bool IsStepRunning() const;
+    // Wait for running step.
+    void EnsureCompletion();
 
-    void InitFlockLeader();
+    //================================= BATCH =====================================
+    // Queue next step for the flock subsystem batch. Game thread only.
+    void QueueStep(float DeltaTime, int32 NumSubsteps);
+    bool IsStepQueued() const { return bStepQueued; }
+    // Batch task runs the queued step. Game thread only.
+    void SetBatchTask(const FGraphEventRef& BatchTask);
+    int32 GetNumSubsteps() const { return StepNumSubsteps; }
+
+    // Parts of Step, so batch runs chunks of all flocks in one ParallelFor. Worker thread of step only.
+    // Prepare write buffer and scratches, returns number of chunks.
+    int32 BeginStep();
+    // Select substep buffers and build grid.
+    void BeginSubstep(int32 Substep);
+    void RunChunk(int32 ChunkIndex);
+    void EndSubstep();
+    // Aggregate stats and publish.
+    void EndStep();
 
-    TArray<FlockMemberData> FlockThreadMembersArr;
+    //================================= FLOCK =====================================
+    // Latest finished step. Game thread only, valid until next call.
+    const FlockStepResult& GetFlockMembersData();
+
+    // Members are divided into NumGroups groups, first member of a group is its leader.
+    void InitFlockParameters(const FlockMemberStore& SetFlockMembers, int32 NumGroups, FlockMemberParameters NewParameters);
+
+    // Call only while step is not running.
+    void SetWorldSnapshot(const FlockWorldSnapshot& Snapshot);
+    // Applied at the end of next step.
+    void SetMemberCommands(const TArray<FlockMemberCommand>& Commands);
+    void SetAvoidanceField(TSharedPtr<const FlockDistanceField, ESPMode::ThreadSafe> NewAvoidanceField);
+    // Record every step into NewRecorder, null stops recording. Call only while step is not running.
+    void SetRecorder(TSharedPtr<FlockReplayRecorder, ESPMode::ThreadSafe> NewRecorder);
+    // Members of all flocks for interaction rules, FlockTypes[i] is type of flock i of the index. Null turns interaction off.
+    // Set by the flock subsystem batch for the duration of the step.
+    void SetSharedIndex(const FlockSharedIndex* NewSharedIndex, const TArray<FName>& FlockTypes, int32 OwnFlockIndex);
+    // Largest radius of interaction rules, 0 without rules.
+    float GetInteractionRadius() const;
+
+    FVector SteeringAquarium(int32 FlockMember) const;
+    // Flee from static obstacles, O(1) lookup in baked distance field.
+    FVector SteeringAvoidanceField(int32 FlockMember) const;
+    // Flee from the nearest obstacle that is not static, by its collision bounds.
+    FVector SteeringMovingObstacles(int32 FlockMember) const;
+    FVector SteeringWander(int32 FlockMember, FVector4& WanderTarget, FRandomStream& Random) const;
+    FVector GetRandomWanderLocation(FRandomStream& Random) const;
+    FVector SteeringFollow(int32 FlockMember, int32 FlockLeader, TArray<AActor*>& OutAttackedActors) const;
+    void GetNearbyFlockMates(int32 FlockMember, TArray<int32>& OutMates) const;
+    // Sums of nearby flock mates for align, separate and cohesion, one pass over mates.
+    void AccumulateFlockMates(int32 FlockMember, const TArray<int32>& FlockMates, FlockMatesSums& OutSums) const;
+    FVector SteeringAlign(int32 FlockMember, const FlockMatesSums& MatesSums) const;
+    FVector SteeringSeparate(int32 FlockMember, const FlockMatesSums& MatesSums) const;
+    FVector SteeringCohesion(int32 FlockMember, const FlockMatesSums& MatesSums) const;
+    FVector SteeringFlee(int32 FlockMember) const;
+    FVector SteeringMaxHeight(int32 FlockMember) const;
+    FVector SteeringFollowPawn(int32 FlockMember, TArray<AActor*>& OutAttackedActors) const;
+    // Flee, chase and avoid members of other flocks by interaction rules.
+    FVector SteeringInteraction(int32 FlockMember) const;
+
+    // Step results exchanged with game thread without lock.
+    TFlockTripleBuffer<FlockStepResult> StepBuffers;
+    // Input and output of current substep. Output of the last substep is the write buffer.
+    const FlockMemberStore* StepMembers = nullptr;
+    FlockMemberStore* NextMembers = nullptr;
+    FlockStepResult* NextStepResult = nullptr;
+    bool bLastSubstep = true;
     FlockMemberParameters FlockParametersTHR;
-    TArray<UPrimitiveComponent*> AllOverlappingComponentsArrTHR;
-    TArray<AActor*> DangerActorsTHR;
-    TArray<AActor*> AvoidanceActorRootArrTHR;
-
-    float ThreadDeltaTime = 0.f;
+    // Only state of the world read by the step.
+    FlockWorldSnapshot WorldSnapshotTHR;
+    TSharedPtr<const FlockDistanceField, ESPMode::ThreadSafe> AvoidanceFieldTHR;
+    const FlockSharedIndex* SharedIndexTHR = nullptr;
+    TSharedPtr<FlockReplayRecorder, ESPMode::ThreadSafe> RecorderTHR;
+    // Flocks of shared index this flock reacts on, and the rule of each. Never the own flock.
+    TArray<int32> InteractionFlocks;
+    TArray<int32> InteractionFlockRules;
+
+    // Delta time of one substep.
+    float StepDeltaTime = 0.f;
+    int32 StepNumSubsteps = 1;
+    // Substeps done since start, spreads LOD updates over steps and numbers net corrections.
+    uint32 SubstepCounter = 0;
+    // Time steering behaviors in this step (Flock.DetailedStats).
+    bool bDetailedStats = false;
+
+    // Leader group of every member and leader of every group, INDEX_NONE for group without active members.
+    // Leaders change only in ApplyMemberCommands, between substeps.
+    TArray<int32> MemberLeaderGroups;
+    TArray<int32> GroupLeaders;
+    // Neighbor search over StepMembers, rebuilt at the start of every step.
+    FlockSpatialGrid Grid;
+
+    // Memory of step buffers, grid and scratches. Call only while step is not running.
+    SIZE_T GetAllocatedSize() const;
     //================================= FLOCK =====================================
 
-    void SetPoolThread(TArray<class FlockThread*> SetPoolThreadArr);
-    
-
 private:
 
-    //Thread to run the worker FRunnable on
-    FRunnableThread* Thread;
-
-    FCriticalSection Mutex;
-    FEvent* Semaphore;
-
-    int ChunkCount;
-    int Amount;
-    int MinInt;
-    int MaxInt;
-
-    float ThreadSleepTime = 0.01f;
-
-    //As the name states those members are Thread safe
-    FThreadSafeBool Kill;
-    FThreadSafeBool Pause;
-
-    TArray<class FlockThread*> PoolThreadArr;
+    // Set leader flags, MemberLeaderGroups and GroupLeaders.
+    void InitFlockLeaders(FlockMemberStore& Members, int32 NumGroups);
+    void SetGroupLeader(FlockMemberStore& Members, int32 LeaderGroup, int32 FlockMemberID);
+    // Spawn and remove members of MemberCommandsTHR in write buffer.
+    void ApplyMemberCommands();
+
+    friend class FlockStepTask;
+    // Whole step, runs on a worker thread.
+    void Step();
+    // Step members from FirstMember to LastMember - 1.
+    void StepChunk(int32 FirstMember, int32 LastMember, FlockChunkScratch& Scratch);
+
+    FlockLOD::Type GetMemberLOD(const FVector& Location) const;
+    // Steps between full updates of members in LOD.
+    int32 GetLODStepInterval(FlockLOD::Type LOD) const;
+
+    // Own step task, or batch task of the flock subsystem.
+    FGraphEventRef StepTask;
+    bool bStepQueued = false;
+    double StepStartTime = 0.0;
+    int32 StepChunkSize = 1;
+    int32 StepNumChunks = 0;
+    ENamedThreads::Type StepTaskThread = ENamedThreads::AnyHiPriThreadNormalTask;
+    EParallelForFlags StepParallelForFlags = EParallelForFlags::Unbalanced;
+
+    TArray<FlockChunkScratch> ChunkScratches;
+    // Output of substeps before the last one.
+    FlockMemberStore SubstepMembers;
+
+    TArray<FlockMemberCommand> MemberCommandsTHR;
+    // Leaders get leader flag, false when follow actor replaces leaders.
+    bool bLeaderFlags = true;
 };
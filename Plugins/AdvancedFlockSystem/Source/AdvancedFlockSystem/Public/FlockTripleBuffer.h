@@ -0,0 +1,82 @@
+// Copyright 2020-2021 Fly Dream Dev. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Templates/Atomic.h"
+
+// Lock free triple buffer for one writer thread and one reader thread.
+// Writer fills write buffer and publishes it with one atomic swap. Reader takes the latest published buffer with one atomic swap.
+template <typename BufferType>
+class TFlockTripleBuffer
+{
+public:
+
+    TFlockTripleBuffer()
+    {
+        WriteIndex = 0;
+        LastPublishedIndex = 1;
+        ReadIndex = 2;
+        ReadyState = 1;
+    }
+
+    // Set all buffers to Value and mark it as published. Not thread safe, call before writer and reader start.
+    void Reset(const BufferType& Value)
+    {
+        for (int32 i = 0; i < 3; ++i)
+        {
+            Buffers[i] = Value;
+        }
+        WriteIndex = 0;
+        LastPublishedIndex = 1;
+        ReadIndex = 2;
+        ReadyState = 1 | NewFlag;
+    }
+
+    //================================= WRITER =====================================
+
+    BufferType& GetWriteBuffer() { return Buffers[WriteIndex]; }
+
+    // Buffer published by the last Publish(). Reader never writes, so it is safe to read it while writing next one.
+    const BufferType& GetLastPublished() const { return Buffers[LastPublishedIndex]; }
+
+    void Publish()
+    {
+        LastPublishedIndex = WriteIndex;
+        WriteIndex = ReadyState.Exchange(WriteIndex | NewFlag) & IndexMask;
+    }
+
+    //================================= READER =====================================
+
+    // Take the latest published buffer. Returns false if nothing was published since last call.
+    bool Consume()
+    {
+        if ((ReadyState.Load() & NewFlag) == 0)
+        {
+            return false;
+        }
+        ReadIndex = ReadyState.Exchange(ReadIndex) & IndexMask;
+        return true;
+    }
+
+    const BufferType& GetReadBuffer() const { return Buffers[ReadIndex]; }
+
+    // Buffer access for setup while both threads are idle.
+    BufferType& GetBuffer(int32 Index) { return Buffers[Index]; }
+    const BufferType& GetBuffer(int32 Index) const { return Buffers[Index]; }
+
+private:
+
+    static constexpr int32 IndexMask = 3;
+    static constexpr int32 NewFlag = 4;
+
+    BufferType Buffers[3];
+
+    // Writer only.
+    int32 WriteIndex;
+    int32 LastPublishedIndex;
+    // Reader only.
+    int32 ReadIndex;
+    // Index of ready buffer and NewFlag if reader did not take it yet.
+    TAtomic<int32> ReadyState;
+};